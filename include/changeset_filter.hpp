@@ -15,7 +15,10 @@
 template <typename T>
 struct changeset_filter : public output_writer {
   changeset_filter(const std::string &, const boost::program_options::variables_map &,
-                   const user_map_t &, const boost::posix_time::ptime &, user_info_level, historical_versions, changeset_discussions);
+                   const user_index &, const boost::posix_time::ptime &, user_info_level, historical_versions, changeset_discussions);
+  // filters a writer of both the full and the no-userinfo file.
+  changeset_filter(const std::string &, const std::string &, const boost::program_options::variables_map &,
+                   const user_index &, const boost::posix_time::ptime &, historical_versions, changeset_discussions);
   virtual ~changeset_filter();
 
   void changesets(const std::vector<changeset> &,
@@ -24,6 +27,8 @@ struct changeset_filter : public output_writer {
   void nodes(const std::vector<node> &, const std::vector<old_tag> &);
   void ways(const std::vector<way> &, const std::vector<way_node> &, const std::vector<old_tag> &);
   void relations(const std::vector<relation> &, const std::vector<relation_member> &, const std::vector<old_tag> &);
+  boost::shared_ptr<output_writer> section(nwr_enum);
+  bool wants(nwr_enum) const;
   void finish();
 
 private:
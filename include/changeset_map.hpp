@@ -1,22 +1,39 @@
 #ifndef CHANGESET_MAP_HPP
 #define CHANGESET_MAP_HPP
 
-#include <vector>
-#include <memory>
-#include <boost/shared_ptr.hpp>
+#include <stddef.h>
+#include <stdint.h>
+#include <utility>
+#include <boost/noncopyable.hpp>
 
-struct changeset_map {
-  typedef int64_t * iterator;
-  typedef const int64_t * const_iterator;
+/**
+ * map of changeset ID to the position in the user_index of the user who
+ * made it, stored as a flat array of 32-bit values indexed by changeset ID. the array is an anonymous
+ * memory mapping, so pages are only allocated when first written to, and
+ * unset entries are the zero pages the kernel provides.
+ *
+ * insert() must not be called concurrently with anything else, but once
+ * all the changesets have been inserted then find() is safe to call from
+ * any number of threads without locking.
+ */
+struct changeset_map : private boost::noncopyable {
   typedef std::pair<int64_t, int64_t> value_type;
 
+  changeset_map();
+  ~changeset_map();
+
   void insert(const value_type &);
 
-  const_iterator find(int64_t) const;
-  const_iterator end() const;
+  // the user index position for the changeset, or -1 if there isn't one.
+  int64_t find(int64_t) const;
 
 private:
-  std::vector<boost::shared_ptr<std::vector<int64_t> > > m_data;
+  void grow(size_t min_capacity);
+
+  // each entry is the user index position plus one, so that zero means
+  // not present.
+  uint32_t *m_data;
+  size_t m_capacity;
 };
 
 #endif /* CHANGESET_MAP_HPP */
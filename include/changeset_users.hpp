@@ -0,0 +1,38 @@
+#ifndef CHANGESET_USERS_HPP
+#define CHANGESET_USERS_HPP
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+#include "changeset_map.hpp"
+#include "types.hpp"
+#include "user_index.hpp"
+
+/**
+ * resolves the public user who made each version of a node, way or
+ * relation from its changeset. the changesets are recorded once, as they
+ * are joined, and the users are then resolved in the join of the elements,
+ * so that the writers don't each need their own map of changesets to users.
+ */
+struct changeset_users : private boost::noncopyable {
+  // the index of public users must outlive this.
+  explicit changeset_users(const user_index &users);
+
+  // record the user of a changeset, whether their data is public or not.
+  // may be called from several threads.
+  void insert(const changeset &cs);
+
+  // the public user of the changeset, or null if the user's data isn't
+  // public. throws if the changeset isn't known. only valid once all the
+  // changesets have been recorded.
+  const user_info *find(int64_t changeset_id) const;
+
+private:
+  const user_index &m_users;
+  // maps to the user's position in the index, rather than their ID, so
+  // that resolving an element's user doesn't need to search the index.
+  // changesets by users whose data isn't public map to a sentinel.
+  changeset_map m_changesets;
+  boost::mutex m_mutex;
+};
+
+#endif /* CHANGESET_USERS_HPP */
@@ -2,22 +2,42 @@
 #define COPY_ELEMENTS_HPP
 
 #include "output_writer.hpp"
+#include "changeset_users.hpp"
 #include <boost/shared_ptr.hpp>
+#include <boost/program_options.hpp>
 #include <vector>
 #include <string>
 
 /**
  * Read the disk database for users, and extract all the public data
- * ones into a map of user ID to display name.
+ * ones into an index of user ID to display name.
  */
-void extract_users(std::map<int64_t, std::string> &display_name_map);
+boost::shared_ptr<const user_index> extract_users();
 
 /**
  * Copy the elements (and associated tags, way nodes, etc...) for
  * some type T, and write them in parallel threads to all of the
- * writers.
+ * writers. The join of elements with their tags and inners is
+ * split over up to "join-threads" threads, each taking a range
+ * of element IDs. Writers which don't want elements of type T are
+ * left out, and nothing is done if none of them do.
+ *
+ * If users isn't null, the changesets are recorded in it and the
+ * users of nodes, ways and relations resolved from it, so this
+ * must be run for changesets before the other types.
  */
 template <typename T>
-void run_threads(std::vector<boost::shared_ptr<output_writer> > writers);
+void run_threads(std::vector<boost::shared_ptr<output_writer> > writers,
+                 const boost::program_options::variables_map &options,
+                 boost::shared_ptr<changeset_users> users);
+
+/**
+ * Copy the nodes, ways and relations concurrently, each to a section
+ * writer created from each of the writers. The sections are finished
+ * when done, ready to be stitched together by the writers' finish().
+ */
+void run_sections(std::vector<boost::shared_ptr<output_writer> > writers,
+                  const boost::program_options::variables_map &options,
+                  boost::shared_ptr<changeset_users> users);
 
 #endif /* COPY_ELEMENTS_HPP */
@@ -0,0 +1,36 @@
+#ifndef CURRENT_VERSIONS_HPP
+#define CURRENT_VERSIONS_HPP
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+#include <string>
+
+/**
+ * when none of the outputs want historical versions, the databases of an
+ * element table and its tag and inner tables keep only the current
+ * versions of the elements. the element table decides which versions those
+ * are as it writes its final database, and the tag and inner tables then
+ * keep only the rows of the versions in it. this is shared between them, so
+ * that the tag and inner tables can wait for that database to be complete.
+ */
+struct current_versions : private boost::noncopyable {
+  explicit current_versions(const std::string &element_table);
+
+  // the name, and so the directory, of the element table's database.
+  const std::string &element_table() const;
+
+  // called when the element table's final database has been written, or
+  // the element table failed to be read, to release anyone waiting on it.
+  void finish();
+
+  // wait until finish() has been called.
+  void wait() const;
+
+private:
+  std::string m_element_table;
+  bool m_finished;
+  mutable boost::mutex m_mutex;
+  mutable boost::condition_variable m_cond;
+};
+
+#endif /* CURRENT_VERSIONS_HPP */
@@ -4,10 +4,14 @@
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/exception/all.hpp>
 #include <boost/thread.hpp>
+#include <boost/shared_ptr.hpp>
 #include <string>
 #include <map>
 #include "stdint.h"
 
+struct version_set;
+struct current_versions;
+
 struct base_thread {
   virtual ~base_thread();
   virtual boost::posix_time::ptime join() = 0;
@@ -20,9 +24,30 @@ struct run_thread : public base_thread {
   boost::thread thr;
   std::string table_name;
 
-  run_thread(std::string table_name_, std::string dump_file, bool resume, unsigned int max_concurrency);
+  // redactions, if given, is the set of redacted versions shared between
+  // an element table and its tag and inner tables. if previous_dir and
+  // new_versions are given, the table is extracted incrementally on top of
+  // its database in previous_dir, with new_versions shared in the same way
+  // to record the versions which are new since then. if current is given,
+  // the database keeps only the current versions of elements, and current
+  // is shared in the same way so that the tag and inner tables can keep
+  // the rows of the versions which the element table kept.
+  run_thread(std::string table_name_, std::string dump_file, bool resume, unsigned int max_concurrency,
+             boost::shared_ptr<version_set> redactions = boost::shared_ptr<version_set>(),
+             std::string previous_dir = std::string(),
+             boost::shared_ptr<version_set> new_versions = boost::shared_ptr<version_set>(),
+             boost::shared_ptr<current_versions> current = boost::shared_ptr<current_versions>());
   ~run_thread();
   boost::posix_time::ptime join();
 };
 
+/**
+ * build the interleaved database for element type T from its separate
+ * element, inner and tag databases, which must already be complete. if
+ * resume is set, an interleaved database which is complete and newer
+ * than all of those is kept.
+ */
+template <typename T>
+void interleave_tables(bool resume);
+
 #endif /* DUMP_ARCHIVE_HPP */
@@ -3,11 +3,32 @@
 
 #include <boost/noncopyable.hpp>
 #include <boost/scoped_ptr.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
 #include <string>
 #include <vector>
+#include <utility>
 
 struct dump_reader 
   : public boost::noncopyable {
+  // returns true for the keys of records which should be dropped.
+  typedef boost::function<bool (const std::string &)> key_filter;
+
+  /**
+   * when none of the outputs want historical versions, only the records of
+   * the current versions of elements are kept in the final database. the
+   * records of an element table are keyed by id and version, so only the
+   * last record for each id is kept, and then only if deleted is false for
+   * its key and value. a tag or inner table instead keeps only the records
+   * whose keys start with the key of a record in the final database of the
+   * element table in elements_subdir, which must already be complete. if
+   * neither is set, all records are kept.
+   */
+  struct current_filter {
+    boost::function<bool (const std::string &, const std::string &)> deleted;
+    std::string elements_subdir;
+  };
+
   dump_reader(const std::string &table_name,
               const std::string &dump_file,
               unsigned int max_concurrency);
@@ -18,10 +39,43 @@ struct dump_reader
   size_t read(std::string &);
   void put(const std::string &, const std::string &);
   void finish();
+  // as finish(), but dropping records matching the filter from the final
+  // database as it's merged.
+  void finish(const key_filter &drop);
+  // as finish(drop), but also merging in the records of the final database
+  // in the previous_subdir directory. where both have a record with the
+  // same key, the one read from the dump is kept.
+  void finish(const key_filter &drop, const std::string &previous_subdir);
+  // as finish(drop, previous_subdir), but keeping only the records of
+  // current versions. previous_subdir may be empty.
+  void finish(const key_filter &drop, const std::string &previous_subdir,
+              const current_filter &current);
 
 private:
   struct pimpl;
   boost::scoped_ptr<pimpl> m_impl;
 };
 
+/**
+ * the sorted records of a table small enough to fit in a single sort block,
+ * which are kept in memory after it's been read from the dump so that they
+ * can be used without reading them back from disk. returns null if the
+ * table isn't in memory, e.g: it was larger or was resumed from disk. the
+ * table is still written to disk as usual, for resuming later.
+ */
+typedef std::vector<std::pair<std::string, std::string> > memory_table_t;
+boost::shared_ptr<const memory_table_t> memory_table(const std::string &table_name);
+
+/**
+ * merge the sorted databases in the source subdirectories into a single
+ * database in subdir, interleaving them so that each element's records
+ * directly follow it. the first prefix_size bytes of each key identify the
+ * element (i.e: id and version) and the index of the source database is
+ * inserted after them as a "kind" byte. sources with empty names are
+ * skipped, but still take up an index.
+ */
+void interleave_databases(const std::string &subdir,
+                          const std::vector<std::string> &sources,
+                          size_t prefix_size);
+
 #endif /* DUMP_READER_HPP */
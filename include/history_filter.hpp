@@ -13,7 +13,9 @@
  */
 template <typename T>
 struct history_filter : public output_writer {
-  history_filter(const std::string &, const boost::program_options::variables_map &, const user_map_t &, const boost::posix_time::ptime &, user_info_level, historical_versions, changeset_discussions);
+  history_filter(const std::string &, const boost::program_options::variables_map &, const user_index &, const boost::posix_time::ptime &, user_info_level, historical_versions, changeset_discussions);
+  // filters a writer of both the full and the no-userinfo file.
+  history_filter(const std::string &, const std::string &, const boost::program_options::variables_map &, const user_index &, const boost::posix_time::ptime &, historical_versions, changeset_discussions);
   virtual ~history_filter();
 
   void changesets(const std::vector<changeset> &,
@@ -22,10 +24,15 @@ struct history_filter : public output_writer {
   void nodes(const std::vector<node> &, const std::vector<old_tag> &);
   void ways(const std::vector<way> &, const std::vector<way_node> &, const std::vector<old_tag> &);
   void relations(const std::vector<relation> &, const std::vector<relation_member> &, const std::vector<old_tag> &);
+  boost::shared_ptr<output_writer> section(nwr_enum);
   void finish();
 
 private:
-  boost::scoped_ptr<T> m_writer;
+  // constructor for a section of the output, filtering the elements sent
+  // to the underlying writer's section writer.
+  explicit history_filter(boost::shared_ptr<output_writer> section_writer);
+
+  boost::shared_ptr<output_writer> m_writer;
   
   // when filtering the history and we reach the end of a block of nodes
   // ways or relations, we don't know whether the final element in the
@@ -9,4 +9,11 @@ typedef std::string slice_t;
 template <typename T>
 void insert_kv(T &t, const slice_t &key, const slice_t &val);
 
+// decode only the key fields, or only the value fields, of a record.
+template <typename T>
+void insert_key(T &t, const slice_t &key);
+
+template <typename T>
+void insert_value(T &t, const slice_t &val);
+
 #endif /* INSERT_KV_HPP */
@@ -0,0 +1,59 @@
+#ifndef NODE_LOCATIONS_HPP
+#define NODE_LOCATIONS_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+
+/**
+ * the locations of nodes, stored as a flat array of latitude and longitude
+ * pairs indexed by node ID, 8 bytes per node. the array is a shared memory
+ * mapping of a temporary file, which is removed as soon as it's opened, so
+ * that the kernel can write the array back to disk rather than keep a whole
+ * planet's worth of locations in memory. as with the changeset map, pages
+ * are only allocated when first written to, and unset entries are zero.
+ *
+ * insert() must not be called concurrently with anything else. once all the
+ * nodes have been inserted, complete() releases any threads waiting for them
+ * and find() is then safe to call from any number of threads.
+ */
+struct node_locations : private boost::noncopyable {
+  // the file is created, and then removed, before this returns.
+  explicit node_locations(const std::string &file_name);
+  ~node_locations();
+
+  void insert(int64_t id, int32_t lat, int32_t lon);
+
+  // the location of the node, or false if there isn't one.
+  bool find(int64_t id, int32_t &lat, int32_t &lon) const;
+
+  // mark all the nodes as inserted, or that they never will be because
+  // writing them failed.
+  void complete();
+  void abandon();
+
+  // wait until all the nodes have been inserted. throws if they were
+  // abandoned.
+  void wait() const;
+
+private:
+  void grow(size_t min_capacity);
+
+  // each coordinate has its sign bit flipped, so that zero means not
+  // present. no valid coordinate is the most negative int32.
+  struct entry {
+    uint32_t lat, lon;
+  };
+
+  int m_fd;
+  entry *m_data;
+  size_t m_capacity;
+
+  enum { state_inserting, state_complete, state_abandoned } m_state;
+  mutable boost::mutex m_mutex;
+  mutable boost::condition_variable m_cond;
+};
+
+#endif /* NODE_LOCATIONS_HPP */
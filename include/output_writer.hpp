@@ -2,8 +2,12 @@
 #define OUTPUT_WRITER_HPP
 
 #include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <ostream>
+#include <string>
 #include <vector>
 #include "types.hpp"
+#include "user_index.hpp"
 
 /**
  * generic output sink for OSM element types.
@@ -13,8 +17,6 @@
  * output to XML, PBF and any other file types which we would want to write.
  */
 struct output_writer : private boost::noncopyable {
-  typedef std::map<int64_t, std::string> user_map_t;
-
   virtual ~output_writer();
 
   // dump a chunk of elements. included are the associated tags and other
@@ -27,6 +29,19 @@ struct output_writer : private boost::noncopyable {
   virtual void ways(const std::vector<way> &, const std::vector<way_node> &, const std::vector<old_tag> &) = 0;
   virtual void relations(const std::vector<relation> &, const std::vector<relation_member> &, const std::vector<old_tag> &) = 0;
 
+  // create a writer for just one section (nodes, ways or relations) of this
+  // output. it will be called after all the changesets have been written, and
+  // the section writers can then be written to concurrently. each writes its
+  // own fragment of the output, which is stitched back together in order by
+  // this writer's finish(). returns a null pointer if this output doesn't
+  // want any elements of that type.
+  virtual boost::shared_ptr<output_writer> section(nwr_enum) = 0;
+
+  // whether this output wants elements of the given type at all. outputs
+  // which don't are left out of writing that type altogether, rather than
+  // being sent blocks only to throw them away. all outputs get changesets.
+  virtual bool wants(nwr_enum) const;
+
   // called once, at the end of the writing process. at this point the
   // output writer should write any remaining data, flush the output
   // file and close it. anything which could throw should be in here,
@@ -34,4 +49,12 @@ struct output_writer : private boost::noncopyable {
   virtual void finish() = 0;
 };
 
+// name of the file that a section writer writes its fragment of the output
+// to, before it gets stitched back into the output file.
+std::string section_file_name(const std::string &file_name, nwr_enum section);
+
+// append the whole contents of a section file to the output, then remove
+// the section file.
+void append_section_file(std::ostream &out, const std::string &section_file);
+
 #endif /* OUTPUT_WRITER */
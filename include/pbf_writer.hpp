@@ -11,7 +11,10 @@
 
 class pbf_writer : public output_writer {
 public:
-  pbf_writer(const std::string &, const boost::program_options::variables_map &, const user_map_t &, const boost::posix_time::ptime &, user_info_level, historical_versions, changeset_discussions);
+  pbf_writer(const std::string &, const boost::program_options::variables_map &, const user_index &, const boost::posix_time::ptime &, user_info_level, historical_versions, changeset_discussions);
+  // writes both the full file and the one without user info, encoding each
+  // block only once for both.
+  pbf_writer(const std::string &, const std::string &, const boost::program_options::variables_map &, const user_index &, const boost::posix_time::ptime &, historical_versions, changeset_discussions);
   virtual ~pbf_writer();
 
   void changesets(const std::vector<changeset> &,
@@ -20,12 +23,23 @@ public:
   void nodes(const std::vector<node> &, const std::vector<old_tag> &);
   void ways(const std::vector<way> &, const std::vector<way_node> &, const std::vector<old_tag> &);
   void relations(const std::vector<relation> &, const std::vector<relation_member> &, const std::vector<old_tag> &);
+  boost::shared_ptr<output_writer> section(nwr_enum);
   void finish();
 
   struct pimpl;
 
 private:
+  // constructor for a section writer, which writes a fragment of each of
+  // the parent's outputs to a separate file.
+  pbf_writer(const pbf_writer &parent, const std::vector<std::string> &section_files);
+
   boost::scoped_ptr<pimpl> m_impl;
+  // the section files of each type, one for each output.
+  std::vector<std::vector<std::string> > m_section_files;
 };
 
+// throws if the PBF compression options are invalid, or name a codec which
+// this build doesn't support.
+void check_pbf_compression(const boost::program_options::variables_map &);
+
 #endif /* PBF_WRITER_HPP */
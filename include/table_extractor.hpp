@@ -3,7 +3,12 @@
 
 #include <string>
 #include <boost/date_time/posix_time/ptime.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/bind.hpp>
 #include "dump_reader.hpp"
+#include "version_set.hpp"
+#include "current_versions.hpp"
+#include "insert_kv.hpp"
 #include "extract_kv.hpp"
 #include "unescape_copy_row.hpp"
 
@@ -18,36 +23,168 @@ template <> boost::posix_time::ptime timestamp_of<way>(const way &w)
 template <> boost::posix_time::ptime timestamp_of<relation>(const relation &r)    { return r.timestamp; }
 template <> boost::posix_time::ptime timestamp_of<changeset_comment>(const changeset_comment &cc) { return cc.created_at; }
 
+// element tables record their redacted versions in the set shared with
+// their tag and inner tables, which then drop the rows for those versions.
+template <typename R> struct records_redactions { static const bool value = false; };
+template <> struct records_redactions<node>     { static const bool value = true; };
+template <> struct records_redactions<way>      { static const bool value = true; };
+template <> struct records_redactions<relation> { static const bool value = true; };
+
+// whether a row should be left out of the database. redacted versions and
+// negative IDs never appear in the output, so there's no point sorting them.
+template <typename R> inline bool skip_row(const R &, version_set *) { return false; }
+
+template <typename R>
+inline bool skip_element_row(const R &r, version_set *redactions) {
+  if (r.id < 0) { return true; }
+  if (r.redaction_id) {
+    if (redactions != NULL) { redactions->insert(r.id, r.version); }
+    return true;
+  }
+  return false;
+}
+
+template <> inline bool skip_row<node>(const node &n, version_set *rs)         { return skip_element_row(n, rs); }
+template <> inline bool skip_row<way>(const way &w, version_set *rs)           { return skip_element_row(w, rs); }
+template <> inline bool skip_row<relation>(const relation &r, version_set *rs) { return skip_element_row(r, rs); }
+template <> inline bool skip_row<changeset>(const changeset &cs, version_set *)                  { return cs.id < 0; }
+template <> inline bool skip_row<current_tag>(const current_tag &t, version_set *)               { return t.element_id < 0; }
+template <> inline bool skip_row<old_tag>(const old_tag &t, version_set *)                       { return t.element_id < 0; }
+template <> inline bool skip_row<way_node>(const way_node &wn, version_set *)                    { return wn.way_id < 0; }
+template <> inline bool skip_row<relation_member>(const relation_member &rm, version_set *)      { return rm.relation_id < 0; }
+template <> inline bool skip_row<changeset_comment>(const changeset_comment &cc, version_set *)  { return cc.changeset_id < 0; }
+
+// whether the key and value of an element table's record are of a deleted
+// version, which isn't current even if it's the latest.
+template <typename R> inline bool is_deleted_record(const std::string &, const std::string &) { return false; }
+
+template <typename R>
+inline bool is_deleted_element(const std::string &value) {
+  R r;
+  insert_value<R>(r, value);
+  return !r.visible;
+}
+
+template <> inline bool is_deleted_record<node>(const std::string &, const std::string &v)     { return is_deleted_element<node>(v); }
+template <> inline bool is_deleted_record<way>(const std::string &, const std::string &v)      { return is_deleted_element<way>(v); }
+template <> inline bool is_deleted_record<relation>(const std::string &, const std::string &v) { return is_deleted_element<relation>(v); }
+
+/**
+ * for extracting a history table incrementally, where the rows which were
+ * already in the previous run's database of the same table are skipped,
+ * and that database is merged in instead.
+ */
+struct previous_run {
+  // directory of the previous run's database of the table.
+  std::string subdir;
+
+  // element rows timestamped after this are new since the previous run.
+  boost::posix_time::ptime since;
+
+  // the versions of the elements which are new, recorded by the element
+  // table so that the tag and inner tables, which don't have timestamps,
+  // can tell which of their rows are new.
+  boost::shared_ptr<version_set> new_versions;
+};
+
 template <typename R>
 struct table_extractor_with_timestamp {
   typedef R row_type;
 
   table_extractor_with_timestamp(const std::string &table_name,
                                  const std::string &dump_file,
-                                 unsigned int max_concurrency)
-    : m_reader(table_name, dump_file, max_concurrency) {
+                                 unsigned int max_concurrency,
+                                 boost::shared_ptr<version_set> redactions,
+                                 boost::shared_ptr<const previous_run> previous = boost::shared_ptr<const previous_run>(),
+                                 boost::shared_ptr<current_versions> current = boost::shared_ptr<current_versions>())
+    : m_reader(table_name, dump_file, max_concurrency),
+      m_redactions(redactions), m_previous(previous), m_current(current) {
   }
 
   boost::posix_time::ptime read() {
+    // the tag and inner tables can't tell which of their rows are new until
+    // the element table has been read, so they aren't read in parallel with
+    // it when extracting incrementally.
+    const bool element_table = records_redactions<R>::value;
+    if (m_previous && !element_table) {
+      m_previous->new_versions->wait();
+    }
+
     boost::posix_time::ptime timestamp(boost::posix_time::neg_infin);
     size_t bytes = 0;
     row_type row;
     unescape_copy_row<dump_reader, row_type> filter(m_reader);
     extract_kv<row_type> extract;
     while ((bytes = filter.read(row)) > 0) {
+      // the timestamp includes skipped rows, so that it's the same as it
+      // was when they were sorted and then dropped in the join.
+      if (timestamp_of<R>(row) > timestamp) {
+        timestamp = timestamp_of<R>(row);
+      }
+      if (skip_row<R>(row, m_redactions.get())) { continue; }
+
       std::string key, val;
       extract(row, key, val);
+
+      if (m_previous) {
+        if (element_table) {
+          if (timestamp_of<R>(row) <= m_previous->since) { continue; }
+          m_previous->new_versions->insert_key(key);
+
+        } else if (!m_previous->new_versions->contains_key(key)) {
+          continue;
+        }
+      }
+
       m_reader.put(key, val);
-      if (timestamp_of<R>(row) > timestamp) {
-        timestamp = timestamp_of<R>(row);
+    }
+
+    // the tags and inners of redacted versions can only be dropped once all
+    // of the element table has been read, which happens in parallel. when
+    // merging with a previous database, the element table also needs to
+    // drop versions which have been redacted since.
+    dump_reader::key_filter drop;
+    if (m_redactions && (m_previous || !element_table)) {
+      if (element_table) {
+        m_redactions->finish();
       }
+      m_redactions->wait();
+      if (!m_redactions->empty()) {
+        drop = boost::bind(&version_set::contains_key, m_redactions.get(), _1);
+      }
+    }
+
+    // when only current versions are wanted, the element table picks them
+    // as it's merged, and the tag and inner tables then keep the rows of
+    // the versions it kept.
+    dump_reader::current_filter current;
+    if (m_current) {
+      if (element_table) {
+        current.deleted = &is_deleted_record<R>;
+
+      } else {
+        m_current->wait();
+        current.elements_subdir = m_current->element_table();
+      }
+    }
+
+    if (m_previous) {
+      if (element_table) {
+        m_previous->new_versions->finish();
+      }
+      m_reader.finish(drop, m_previous->subdir, current);
+
+    } else {
+      m_reader.finish(drop, std::string(), current);
     }
-    m_reader.finish();
     return timestamp;
   }
 
 private:
   dump_reader m_reader;
+  boost::shared_ptr<version_set> m_redactions;
+  boost::shared_ptr<const previous_run> m_previous;
+  boost::shared_ptr<current_versions> m_current;
 };
 
 #endif /* TABLE_EXTRACTOR_HPP */
@@ -26,6 +26,14 @@ enum nwr_enum {
   nwr_relation
 };
 
+// a public user's id and display name, as held in the user_index. the
+// name points into the index's string arena and is NUL-terminated.
+struct user_info {
+  int64_t id;
+  const char *display_name;
+  size_t display_name_length;
+};
+
 struct user {
   static const int num_keys = 1;
   static const std::vector<std::string> &column_names();
@@ -82,6 +90,7 @@ struct changeset {
   static const std::string table_name();
   static const std::string tag_table_name();
   static const std::string inner_table_name();
+  static const std::string interleaved_table_name();
 
   typedef current_tag tag_type;
   typedef changeset_comment inner_type;
@@ -129,6 +138,7 @@ struct node {
   static const std::string table_name();
   static const std::string tag_table_name();
   static const std::string inner_table_name();
+  static const std::string interleaved_table_name();
 
   typedef old_tag tag_type;
   typedef int inner_type;
@@ -138,6 +148,11 @@ struct node {
   boost::posix_time::ptime timestamp;
   boost::optional<int64_t> redaction_id;
   int32_t latitude, longitude;
+
+  // the public user who made this version, resolved from its changeset in
+  // the join. null if the user's data isn't public or isn't wanted. this
+  // isn't stored in the database.
+  const user_info *user;
 };
 
 BOOST_FUSION_ADAPT_STRUCT(
@@ -173,6 +188,7 @@ struct way {
   static const std::string table_name();
   static const std::string tag_table_name();
   static const std::string inner_table_name();
+  static const std::string interleaved_table_name();
 
   typedef old_tag tag_type;
   typedef way_node inner_type;
@@ -181,6 +197,9 @@ struct way {
   bool visible;
   boost::posix_time::ptime timestamp;
   boost::optional<int64_t> redaction_id;
+
+  // not stored in the database, see node::user.
+  const user_info *user;
 };
 
 BOOST_FUSION_ADAPT_STRUCT(
@@ -219,6 +238,7 @@ struct relation {
   static const std::string table_name();
   static const std::string tag_table_name();
   static const std::string inner_table_name();
+  static const std::string interleaved_table_name();
 
   typedef old_tag tag_type;
   typedef relation_member inner_type;
@@ -227,6 +247,9 @@ struct relation {
   bool visible;
   boost::posix_time::ptime timestamp;
   boost::optional<int64_t> redaction_id;
+
+  // not stored in the database, see node::user.
+  const user_info *user;
 };
 
 BOOST_FUSION_ADAPT_STRUCT(
@@ -0,0 +1,47 @@
+#ifndef USER_INDEX_HPP
+#define USER_INDEX_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include "types.hpp"
+
+/**
+ * index of the public users' display names by user ID. the users are held
+ * sorted by ID in one flat array, and all their names are packed together
+ * into a single string arena, so a lookup is a binary search over
+ * contiguous memory rather than chasing the nodes of a tree, and there's
+ * one allocation for all the names rather than one each.
+ *
+ * the index is built once, with push_back() and finish(), and is then
+ * read-only, so it can be shared by all the writers and looked up from any
+ * number of threads without locking.
+ */
+struct user_index : private boost::noncopyable {
+  user_index();
+
+  // add a user, which must have a greater ID than any added before it.
+  void push_back(int64_t id, const std::string &display_name);
+
+  // must be called after the last user has been added, and before the
+  // index is used. the arena doesn't move after this.
+  void finish();
+
+  // the user with the given ID, or null if there is no public user with
+  // that ID.
+  const user_info *find(int64_t id) const;
+
+  // users can also be referred to by their position in the index, which
+  // is smaller than their ID.
+  size_t size() const { return m_users.size(); }
+  const user_info &operator[](size_t i) const { return m_users[i]; }
+  size_t position(const user_info &u) const { return &u - &m_users[0]; }
+
+private:
+  std::vector<user_info> m_users;
+  std::string m_arena;
+};
+
+#endif /* USER_INDEX_HPP */
@@ -0,0 +1,55 @@
+#ifndef VERSION_SET_HPP
+#define VERSION_SET_HPP
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+#include <string>
+#include <vector>
+#include <utility>
+#include <stdint.h>
+
+/**
+ * a set of (id, version) keys of one type of element, which is filled in
+ * while the element table is read from the dump and then shared with its
+ * tag and inner tables. it's used for the redacted versions, so that the
+ * matching tag and inner rows can be dropped before they are written out
+ * to the final database, and when extracting incrementally, for the
+ * versions which are new since the previous run, so that the matching tag
+ * and inner rows can be kept.
+ */
+struct version_set : private boost::noncopyable {
+  version_set();
+
+  // add a version, only before finish() is called.
+  void insert(int64_t id, int64_t version);
+
+  // add the version which a key starts with, as for contains_key().
+  void insert_key(const std::string &key);
+
+  // called when all the versions have been added, or the element
+  // table failed to be read, to release anyone waiting on the set.
+  void finish();
+
+  // wait until finish() has been called.
+  void wait() const;
+
+  bool empty() const;
+
+  // whether the key of a tag or inner row, which starts with the id and
+  // version of its element, belongs to a version in the set. only valid
+  // after wait() has returned.
+  bool contains_key(const std::string &key) const;
+
+  // save or load the set, so that it's available for tag and inner tables
+  // when the element table is resumed rather than read again.
+  void save(const std::string &file_name) const;
+  void load(const std::string &file_name);
+
+private:
+  std::vector<std::pair<int64_t, int64_t> > m_versions;
+  bool m_finished;
+  mutable boost::mutex m_mutex;
+  mutable boost::condition_variable m_cond;
+};
+
+#endif /* VERSION_SET_HPP */
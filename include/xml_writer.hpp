@@ -2,7 +2,6 @@
 #define XML_WRITER_HPP
 
 #include "output_writer.hpp"
-#include "changeset_map.hpp"
 #include <ostream>
 #include <boost/scoped_ptr.hpp>
 #include <boost/date_time/posix_time/ptime.hpp>
@@ -12,11 +11,14 @@
 
 class xml_writer : public output_writer {
 public:
-  typedef changeset_map changeset_map_t;
-
-  xml_writer(const std::string &, const boost::program_options::variables_map &, const user_map_t &,
+  xml_writer(const std::string &, const boost::program_options::variables_map &, const user_index &,
              const boost::posix_time::ptime &max_time,
              user_info_level, historical_versions, changeset_discussions);
+  // writes both the full file and the one without user info, serialising
+  // each element only once for both.
+  xml_writer(const std::string &, const std::string &, const boost::program_options::variables_map &,
+             const user_index &, const boost::posix_time::ptime &max_time,
+             historical_versions, changeset_discussions);
   virtual ~xml_writer();
 
   void changesets(const std::vector<changeset> &,
@@ -25,13 +27,22 @@ public:
   void nodes(const std::vector<node> &, const std::vector<old_tag> &);
   void ways(const std::vector<way> &, const std::vector<way_node> &, const std::vector<old_tag> &);
   void relations(const std::vector<relation> &, const std::vector<relation_member> &, const std::vector<old_tag> &);
+  boost::shared_ptr<output_writer> section(nwr_enum);
   void finish();
 
   struct pimpl;
 
 private:
+  // constructor for a section writer, which writes a fragment of the
+  // parent's output to a separate file. the anon section file is empty
+  // unless the parent also writes a file without user info.
+  xml_writer(const xml_writer &parent, const std::string &section_file,
+             const std::string &anon_section_file);
+
+  void write_header();
+
   boost::scoped_ptr<pimpl> m_impl;
-  const user_map_t &m_users;
+  const user_index &m_users;
   changeset_discussions m_changeset_discussions;
   user_info_level m_user_info_level;
   std::string m_generator_name;
@@ -39,7 +50,8 @@ private:
   std::string m_source_name;
   std::string m_copyleft_name;
   std::string m_attribution_name;
-  changeset_map_t m_changesets;
+  bool m_is_section;
+  std::vector<std::string> m_section_files;
 };
 
 #endif /* XML_WRITER_HPP */
@@ -6,9 +6,17 @@
 
 template <typename T>
 changeset_filter<T>::changeset_filter(const std::string &option_name, const boost::program_options::variables_map &options,
-                                      const user_map_t &user_map, const boost::posix_time::ptime &max_time, user_info_level uil,
-                                      historical_versions hv, changeset_discussions cd)
-  : m_writer(new T(option_name, options, user_map, max_time, uil, historical_versions::NONE, cd)) {
+                                      const user_index &users, const boost::posix_time::ptime &max_time, user_info_level uil,
+                                      historical_versions, changeset_discussions cd)
+  : m_writer(new T(option_name, options, users, max_time, uil, historical_versions::NONE, cd)) {
+}
+
+template <typename T>
+changeset_filter<T>::changeset_filter(const std::string &option_name, const std::string &anon_option_name,
+                                      const boost::program_options::variables_map &options,
+                                      const user_index &users, const boost::posix_time::ptime &max_time,
+                                      historical_versions, changeset_discussions cd)
+  : m_writer(new T(option_name, anon_option_name, options, users, max_time, historical_versions::NONE, cd)) {
 }
 
 template <typename T>
@@ -38,6 +46,18 @@ void changeset_filter<T>::relations(const std::vector<relation> &rs, const std::
   // do nothing - we don't want relations in the changeset output
 }
 
+template <typename T>
+boost::shared_ptr<output_writer> changeset_filter<T>::section(nwr_enum) {
+  // no sections - we don't want any elements in the changeset output
+  return boost::shared_ptr<output_writer>();
+}
+
+template <typename T>
+bool changeset_filter<T>::wants(nwr_enum) const {
+  // no nodes, ways or relations in the changeset output
+  return false;
+}
+
 template <typename T>
 void changeset_filter<T>::finish() {
   // finish the underlying output writer
@@ -1,54 +1,74 @@
 #include "changeset_map.hpp"
-#include <boost/make_shared.hpp>
 
-#define BLOCK_BITS 17
-#define BLOCK_SIZE (1L << BLOCK_BITS)
-#define BLOCK_MASK (BLOCK_SIZE - 1)
+#include <sys/mman.h>
+#include <errno.h>
+#include <cassert>
+#include <limits>
+#include <stdexcept>
+#include <boost/format.hpp>
+#include <boost/throw_exception.hpp>
+
+// number of entries initially mapped, which is doubled whenever a larger
+// changeset ID is inserted. this is only address space until it's used.
+#define INITIAL_CAPACITY (size_t(1) << 20)
+
+changeset_map::changeset_map()
+  : m_data(NULL), m_capacity(0) {
+}
+
+changeset_map::~changeset_map() {
+  if (m_data != NULL) {
+    munmap(m_data, m_capacity * sizeof(uint32_t));
+  }
+}
 
 void changeset_map::insert(const changeset_map::value_type &kv) {
-  assert(kv.first > 0);
+  assert(kv.first >= 0);
   assert(kv.second >= 0);
 
-  const size_t block_id = kv.first >> BLOCK_BITS;
-  const size_t offset = kv.first & BLOCK_MASK;
-
-  if (block_id >= m_data.size()) {
-    m_data.resize(block_id + 1);
+  if (kv.second >= int64_t(std::numeric_limits<uint32_t>::max())) {
+    BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("User index position %1% of changeset %2% is too large for the changeset map.") % kv.second % kv.first).str()));
   }
 
-  boost::shared_ptr<std::vector<int64_t> > ptr = m_data[block_id];
-  if (!ptr) {
-    ptr = boost::make_shared<std::vector<int64_t> >(BLOCK_SIZE, int64_t(-1));
-    m_data[block_id] = ptr;
+  const size_t id = size_t(kv.first);
+  if (id >= m_capacity) {
+    grow(id + 1);
   }
 
-  std::vector<int64_t> &vec = *ptr;
-  vec[offset] = kv.second;
+  m_data[id] = uint32_t(kv.second) + 1;
 }
 
-changeset_map::const_iterator changeset_map::find(int64_t k) const {
-  if (k < 1) { return NULL; }
+int64_t changeset_map::find(int64_t k) const {
+  if ((k < 0) || (size_t(k) >= m_capacity)) { return -1; }
 
-  const size_t block_id = k >> BLOCK_BITS;
-  const size_t offset = k & BLOCK_MASK;
+  const uint32_t val = m_data[k];
+  return (val == 0) ? int64_t(-1) : int64_t(val) - 1;
+}
 
-  if (block_id >= m_data.size()) {
-    return NULL;
+void changeset_map::grow(size_t min_capacity) {
+  size_t capacity = (m_capacity > 0) ? m_capacity : INITIAL_CAPACITY;
+  while (capacity < min_capacity) {
+    capacity *= 2;
   }
 
-  boost::shared_ptr<std::vector<int64_t> > ptr = m_data[block_id];
-  if (!ptr) {
-    return NULL;
-  }
+  const size_t old_bytes = m_capacity * sizeof(uint32_t);
+  const size_t new_bytes = capacity * sizeof(uint32_t);
+  void *ptr = MAP_FAILED;
+
+  if (m_data == NULL) {
+    ptr = mmap(NULL, new_bytes, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
 
-  std::vector<int64_t> &vec = *ptr;
-  if (vec[offset] < 0) {
-    return NULL;
   } else {
-    return &vec[offset];
+    // moving the mapping keeps the untouched pages unallocated, which
+    // copying them wouldn't.
+    ptr = mremap(m_data, old_bytes, new_bytes, MREMAP_MAYMOVE);
+  }
+
+  if (ptr == MAP_FAILED) {
+    BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unable to map %1% bytes for the changeset map, errno = %2%.") % new_bytes % errno).str()));
   }
-}
 
-changeset_map::const_iterator changeset_map::end() const {
-  return NULL;
+  m_data = static_cast<uint32_t *>(ptr);
+  m_capacity = capacity;
 }
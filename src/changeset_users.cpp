@@ -0,0 +1,41 @@
+#include "changeset_users.hpp"
+
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <boost/throw_exception.hpp>
+
+namespace {
+
+// recorded for changesets by users whose data isn't public, so that they
+// can be told apart from changesets which aren't known at all. this is
+// the largest position which the changeset map can hold.
+const int64_t private_user = int64_t(std::numeric_limits<uint32_t>::max()) - 1;
+
+} // anonymous namespace
+
+changeset_users::changeset_users(const user_index &users)
+  : m_users(users) {
+}
+
+void changeset_users::insert(const changeset &cs) {
+  const user_info *u = m_users.find(cs.uid);
+  const int64_t position = (u == NULL) ? private_user : int64_t(m_users.position(*u));
+
+  boost::lock_guard<boost::mutex> lock(m_mutex);
+  m_changesets.insert(std::make_pair(cs.id, position));
+}
+
+const user_info *changeset_users::find(int64_t changeset_id) const {
+  const int64_t position = m_changesets.find(changeset_id);
+  if (position < 0) {
+    std::ostringstream out;
+    out << "Unable to find changeset " << changeset_id
+        << " in changeset-to-user map.";
+    BOOST_THROW_EXCEPTION(std::runtime_error(out.str()));
+  }
+  if (position == private_user) {
+    return NULL;
+  }
+  return &m_users[position];
+}
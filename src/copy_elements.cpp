@@ -1,12 +1,18 @@
 #include "copy_elements.hpp"
 #include "insert_kv.hpp"
 #include "types.hpp"
+#include "dump_reader.hpp"
+#include "changeset_users.hpp"
 #include "config.h"
 
 #include <string>
 #include <stdexcept>
 #include <iostream>
 #include <fstream>
+#include <deque>
+#include <limits>
+#include <algorithm>
+#include <utility>
 
 #include <boost/format.hpp>
 #include <boost/noncopyable.hpp>
@@ -17,6 +23,7 @@
 #include <boost/thread.hpp>
 #include <boost/make_shared.hpp>
 #include <boost/foreach.hpp>
+#include <boost/scoped_ptr.hpp>
 
 #include <boost/filesystem.hpp>
 #include <boost/iostreams/stream.hpp>
@@ -33,26 +40,88 @@ namespace fs = boost::filesystem;
 namespace {
 
 template <typename T>
-struct control_block {
+struct element_block {
   typedef typename T::tag_type tag_type;
   typedef typename T::inner_type inner_type;
 
-  control_block(unsigned int num_threads)
-  : pre_swap_barrier(num_threads),
-    post_swap_barrier(num_threads),
-    thread_status(num_threads, 0) {
+  std::vector<T> elements;
+  std::vector<tag_type> tags;
+  std::vector<inner_type> inners;
+};
+
+/**
+ * bounded ring of blocks published by the reader thread, which each of the
+ * writer threads reads through at its own pace. blocks are immutable once
+ * published and shared between all the writers. the reader only has to
+ * wait when the slowest writer is a whole ring of blocks behind.
+ */
+template <typename T>
+struct block_ring : private boost::noncopyable {
+  typedef boost::shared_ptr<const element_block<T> > block_ptr;
+
+  block_ring(size_t num_readers, size_t capacity)
+    : m_slots(std::max(capacity, size_t(1))),
+      m_cursors(num_readers, 0),
+      m_published(0),
+      m_released(0) {
   }
 
-  boost::barrier pre_swap_barrier, post_swap_barrier;
+  // publish a block, or a null pointer to mark the end of the blocks.
+  void publish(block_ptr block) {
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    // nobody to read it, so nothing to do.
+    if (m_cursors.empty()) { return; }
+
+    while ((m_published - m_released) >= m_slots.size()) {
+      m_cond.wait(lock);
+    }
+    m_slots[m_published % m_slots.size()] = block;
+    ++m_published;
+    m_cond.notify_all();
+  }
+
+  // get the next block for the given reader, waiting until it's published.
+  block_ptr next(size_t reader) {
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    uint64_t &cursor = m_cursors[reader];
+    while (cursor == m_published) {
+      m_cond.wait(lock);
+    }
+    block_ptr block = m_slots[cursor % m_slots.size()];
+    ++cursor;
+
+    // drop the ring's reference to any blocks which all the readers are
+    // now past, so that they can be freed as soon as they're written.
+    const uint64_t min_cursor = *std::min_element(m_cursors.begin(), m_cursors.end());
+    while (m_released < min_cursor) {
+      m_slots[m_released % m_slots.size()].reset();
+      ++m_released;
+    }
+    m_cond.notify_all();
+
+    return block;
+  }
+
+private:
+  std::vector<block_ptr> m_slots;
+  std::vector<uint64_t> m_cursors;
+  uint64_t m_published, m_released;
+  boost::mutex m_mutex;
+  boost::condition_variable m_cond;
+};
+
+template <typename T>
+struct control_block {
+  control_block(unsigned int num_writers, unsigned int max_queued_blocks)
+  : thread_status(num_writers + 1, 0),
+    blocks(num_writers, max_queued_blocks) {
+  }
 
   std::vector<int> thread_status;
   boost::mutex thread_finished_mutex;
   boost::condition_variable thread_finished_cond;
 
-  std::vector<T> elements;
-  std::vector<tag_type> tags;
-  std::vector<inner_type> inners;
-  std::vector<changeset_comment> comments;
+  block_ring<T> blocks;
 };
 
 template <typename T>
@@ -65,17 +134,230 @@ struct thread_writer {
   thread_writer(boost::shared_ptr<control_block<T> > b) : blk(b) {}
 
   void write(std::vector<T> &els, std::vector<inner_type> &inners, std::vector<tag_type> &tags) {
-    blk->pre_swap_barrier.wait();
-    std::swap(els, blk->elements);
-    std::swap(inners, blk->inners);
-    std::swap(tags, blk->tags);
-    blk->post_swap_barrier.wait();
+    boost::shared_ptr<element_block<T> > block = boost::make_shared<element_block<T> >();
+    std::swap(els, block->elements);
+    std::swap(inners, block->inners);
+    std::swap(tags, block->tags);
+    write(block);
+  }
+
+  void write(boost::shared_ptr<const element_block<T> > block) {
+    blk->blocks.publish(block);
+  }
+
+  // tell the writers there are no more blocks.
+  void finish() {
+    blk->blocks.publish(boost::shared_ptr<const element_block<T> >());
   }
 };
 
+/**
+ * bounded queue of blocks from a join worker, which is read by the reader
+ * thread to pass the blocks on to the writers in order.
+ */
+template <typename T>
+struct block_queue : private boost::noncopyable {
+  typedef typename T::tag_type tag_type;
+  typedef typename T::inner_type inner_type;
+
+  explicit block_queue(size_t capacity) : m_capacity(capacity), m_finished(false) {}
+
+  // called from the join worker, blocks while the queue is full.
+  void write(std::vector<T> &els, std::vector<inner_type> &inners, std::vector<tag_type> &tags) {
+    boost::shared_ptr<element_block<T> > block = boost::make_shared<element_block<T> >();
+    std::swap(els, block->elements);
+    std::swap(inners, block->inners);
+    std::swap(tags, block->tags);
+
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    while (m_blocks.size() >= m_capacity) {
+      m_cond.wait(lock);
+    }
+    m_blocks.push_back(block);
+    m_cond.notify_all();
+  }
+
+  // called from the join worker when it has no more blocks, with the
+  // exception it threw, if any.
+  void finish(boost::exception_ptr error) {
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+    m_finished = true;
+    m_error = error;
+    m_cond.notify_all();
+  }
+
+  // returns the next block, or a null pointer when the worker has finished.
+  boost::shared_ptr<element_block<T> > pop() {
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    while (m_blocks.empty() && !m_finished) {
+      m_cond.wait(lock);
+    }
+    boost::shared_ptr<element_block<T> > block;
+    if (!m_blocks.empty()) {
+      block = m_blocks.front();
+      m_blocks.pop_front();
+      m_cond.notify_all();
+
+    } else if (m_error) {
+      boost::rethrow_exception(m_error);
+    }
+    return block;
+  }
+
+private:
+  const size_t m_capacity;
+  bool m_finished;
+  boost::exception_ptr m_error;
+  std::deque<boost::shared_ptr<element_block<T> > > m_blocks;
+  boost::mutex m_mutex;
+  boost::condition_variable m_cond;
+};
+
+/**
+ * entry in the index written alongside each sorted database, giving the
+ * offset of a compressed segment of the database file, the number of
+ * records in it and the key of its first record.
+ */
+struct index_entry {
+  uint64_t offset, num_records;
+  std::string key;
+};
+
+std::vector<index_entry> read_index(const std::string &subdir) {
+  std::vector<index_entry> index;
+  const std::string file_name = (boost::format("%1$s/final_%2$08x.index") % subdir % 0).str();
+  std::ifstream in(file_name.c_str(), std::ios::binary);
+
+  while (in.is_open()) {
+    index_entry entry;
+    uint32_t key_size = 0;
+    if (!in.read((char *)&entry.offset, sizeof(uint64_t))) { break; }
+    if (!in.read((char *)&entry.num_records, sizeof(uint64_t))) { break; }
+    if (!in.read((char *)&key_size, sizeof(uint32_t))) { break; }
+    entry.key.resize(key_size);
+    if ((key_size > 0) && !in.read(&entry.key[0], key_size)) { break; }
+    index.push_back(entry);
+  }
+
+  // a database written without an index is treated as a single segment.
+  if (index.empty()) {
+    index_entry entry;
+    entry.offset = 0;
+    entry.num_records = std::numeric_limits<uint64_t>::max();
+    index.push_back(entry);
+  }
+
+  return index;
+}
+
+// offset to start reading a database from to be sure of seeing all the
+// records with keys at or after the given one. this relies on the keys of
+// tags and inners starting with the key of the element they belong to.
+uint64_t start_offset(const std::vector<index_entry> &index, const std::string &key) {
+  uint64_t offset = index.front().offset;
+  BOOST_FOREACH(const index_entry &entry, index) {
+    if (entry.key < key) {
+      offset = entry.offset;
+    } else {
+      break;
+    }
+  }
+  return offset;
+}
+
+// the position of the first record in the segment of the database at the
+// given offset, for reading a table kept in memory from the same place.
+size_t record_position(const std::vector<index_entry> &index, uint64_t offset) {
+  uint64_t position = 0;
+  BOOST_FOREACH(const index_entry &entry, index) {
+    if (entry.offset >= offset) { break; }
+    if (entry.num_records == std::numeric_limits<uint64_t>::max()) { break; }
+    position += entry.num_records;
+  }
+  return size_t(position);
+}
+
+/**
+ * a range of elements to be joined with their tags and inners, given as
+ * the offsets to start reading each database from and the number of
+ * element records to read.
+ */
+struct element_range {
+  uint64_t element_offset, tag_offset, inner_offset;
+  uint64_t num_records;
+};
+
+template <typename T>
+std::vector<element_range> element_ranges(size_t max_ranges, bool interleaved) {
+  // an interleaved database has the tags and inners in the same file as
+  // the elements, so all the offsets are the same.
+  const std::vector<index_entry> index = read_index(interleaved ? T::interleaved_table_name() : T::table_name());
+  std::vector<index_entry> tag_index, inner_index;
+  if (interleaved) {
+    tag_index = index;
+    inner_index = index;
+
+  } else {
+    tag_index = read_index(T::tag_table_name());
+    if (!T::inner_table_name().empty()) {
+      inner_index = read_index(T::inner_table_name());
+    }
+  }
+
+  std::vector<element_range> ranges;
+  const size_t num_ranges = std::max(size_t(1), std::min(max_ranges, index.size()));
+  for (size_t i = 0; i < num_ranges; ++i) {
+    const size_t begin = (i * index.size()) / num_ranges;
+    const size_t end = ((i + 1) * index.size()) / num_ranges;
+    if (begin == end) { continue; }
+
+    element_range range;
+    range.element_offset = index[begin].offset;
+    range.tag_offset = start_offset(tag_index, index[begin].key);
+    range.inner_offset = inner_index.empty() ? 0 : start_offset(inner_index, index[begin].key);
+    range.num_records = 0;
+    for (size_t j = begin; j < end; ++j) {
+      if (index[j].num_records == std::numeric_limits<uint64_t>::max()) {
+        range.num_records = index[j].num_records;
+        break;
+      }
+      range.num_records += index[j].num_records;
+    }
+    ranges.push_back(range);
+  }
+
+  return ranges;
+}
+
+/**
+ * an undecoded record, as read from an interleaved database, where the
+ * kind of record isn't known until the key has been read.
+ */
+struct kv_record {
+  std::string key, value;
+};
+
+template <typename T>
+inline void decode_key(T &t, const std::string &key) { insert_key(t, key); }
+
+template <typename T>
+inline void decode_value(T &t, const std::string &val) { insert_value(t, val); }
+
+template <> inline void decode_key<kv_record>(kv_record &r, const std::string &key) { r.key = key; }
+template <> inline void decode_value<kv_record>(kv_record &r, const std::string &val) { r.value = val; }
+
 template <typename T>
 struct db_reader {
-  explicit db_reader(const std::string &subdir) : m_end(false) {
+  db_reader(const std::string &subdir, uint64_t offset)
+    : m_end(false), m_value_pending(false), m_pending_value(NULL),
+      m_table(memory_table(subdir)), m_pos(0) {
+    // tables kept in memory are read from there, starting at the record
+    // which the offset in the on-disk database corresponds to.
+    if (m_table) {
+      m_pos = record_position(read_index(subdir), offset);
+      return;
+    }
+
     m_file_name = (boost::format("%1$s/final_%2$08x.data") % subdir % 0).str();
     if (!fs::exists(m_file_name)) {
       BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("File '%1%' does not exist.") % m_file_name).str()));
@@ -87,19 +369,47 @@ struct db_reader {
     if (!m_file.good()) {
       BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("File '%1%' is open, but not good.") % m_file_name).str()));
     }
+    if (offset > 0) {
+      m_file.seekg(offset);
+      if (!m_file.good()) {
+        BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unable to seek to %1% in '%2%'.") % offset % m_file_name).str()));
+      }
+    }
 
     m_stream.push(bio::gzip_decompressor());
     m_stream.push(m_file);
   }
 
   ~db_reader() {
-    bio::close(m_stream);
-    m_file.close();
+    if (!m_table) {
+      bio::close(m_stream);
+      m_file.close();
+    }
   }
 
   bool operator()(T &t) {
+    if (!key(t)) { return false; }
+    value(t);
+    return true;
+  }
+
+  // read the next record, but decode only its key into t. the value is
+  // kept undecoded until value() is called, so that records which the
+  // caller skips over by key are never fully decoded.
+  bool key(T &t) {
     static const uint16_t max_uint16_t = std::numeric_limits<uint16_t>::max();
+    m_value_pending = false;
     if (m_end) { return false; }
+
+    if (m_table) {
+      if (m_pos >= m_table->size()) { m_end = true; return false; }
+      const std::pair<std::string, std::string> &kv = (*m_table)[m_pos++];
+      decode_key(t, kv.first);
+      m_pending_value = &kv.second;
+      m_value_pending = true;
+      return true;
+    }
+
     uint16_t ksz = 0, vsz = 0;
     uint64_t kextsz = 0, vextsz = 0;
     
@@ -114,19 +424,32 @@ struct db_reader {
 
     size_t key_size = (ksz == max_uint16_t) ? size_t(kextsz) : size_t(ksz);
     size_t val_size = (vsz == max_uint16_t) ? size_t(vextsz) : size_t(vsz);
-    std::string k, v;
-    k.resize(key_size);
-    if (bio::read(m_stream, &k[0], key_size) != key_size) { m_end = true; return false; }
-    v.resize(val_size);
-    if (bio::read(m_stream, &v[0], val_size) != val_size) { m_end = true; return false; }
+    m_key.resize(key_size);
+    if (bio::read(m_stream, &m_key[0], key_size) != key_size) { m_end = true; return false; }
+    m_value.resize(val_size);
+    if (bio::read(m_stream, &m_value[0], val_size) != val_size) { m_end = true; return false; }
 
-    insert_kv(t, k, v);
+    decode_key(t, m_key);
+    m_pending_value = &m_value;
+    m_value_pending = true;
 
     return true;
   }
 
+  // decode the value of the record most recently read by key().
+  void value(T &t) {
+    if (m_value_pending) {
+      decode_value(t, *m_pending_value);
+      m_value_pending = false;
+    }
+  }
+
 private:
-  bool m_end;
+  bool m_end, m_value_pending;
+  std::string m_key, m_value;
+  const std::string *m_pending_value;
+  boost::shared_ptr<const memory_table_t> m_table;
+  size_t m_pos;
   std::string m_file_name;
   std::ifstream m_file;
   bio::filtering_streambuf<bio::input> m_stream;
@@ -134,12 +457,169 @@ private:
 
 template <>
 struct db_reader<int> {
-  db_reader(const std::string &) {}
+  db_reader(const std::string &, uint64_t) {}
 };
 
+/**
+ * reads records from a database, decompressing them ahead of the caller in
+ * batches on a thread of its own, if read_ahead is set. this means the
+ * element, tag and inner databases being joined can each be decompressed
+ * on a different core.
+ *
+ * key() and value() split decoding of a record in the same way as on
+ * db_reader. when reading ahead, the prefetch thread only splits the
+ * records into their undecoded keys and values, as it can't know which
+ * the caller will skip, and they're decoded by the caller.
+ */
+template <typename T>
+struct prefetch_reader : private boost::noncopyable {
+  prefetch_reader(const std::string &subdir, uint64_t offset, bool read_ahead)
+    : m_pos(0), m_record(NULL), m_finished(false), m_stopped(false) {
+    if (read_ahead) {
+      m_raw_reader.reset(new db_reader<kv_record>(subdir, offset));
+      m_thread.reset(new boost::thread(boost::bind(&prefetch_reader<T>::run, this)));
+    } else {
+      m_reader.reset(new db_reader<T>(subdir, offset));
+    }
+  }
+
+  ~prefetch_reader() {
+    if (m_thread) {
+      // the caller may stop before the end of the database, in which case
+      // the thread might be waiting for room to put another batch.
+      {
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+        m_stopped = true;
+        m_cond.notify_all();
+      }
+      m_thread->join();
+    }
+  }
+
+  bool operator()(T &t) {
+    if (!key(t)) { return false; }
+    value(t);
+    return true;
+  }
+
+  bool key(T &t) {
+    if (!m_thread) { return m_reader->key(t); }
+
+    m_record = NULL;
+    if (m_pos == m_batch.size()) {
+      m_batch.clear();
+      m_pos = 0;
+
+      boost::unique_lock<boost::mutex> lock(m_mutex);
+      while (m_batches.empty() && !m_finished) {
+        m_cond.wait(lock);
+      }
+      if (m_batches.empty()) {
+        if (m_error) { boost::rethrow_exception(m_error); }
+        return false;
+      }
+      std::swap(m_batch, m_batches.front());
+      m_batches.pop_front();
+      m_cond.notify_all();
+    }
+
+    m_record = &m_batch[m_pos];
+    ++m_pos;
+    decode_key(t, m_record->key);
+    return true;
+  }
+
+  void value(T &t) {
+    if (!m_thread) {
+      m_reader->value(t);
+
+    } else if (m_record != NULL) {
+      decode_value(t, m_record->value);
+      m_record = NULL;
+    }
+  }
+
+private:
+  static const size_t batch_size = 4096;
+  static const size_t max_batches = 4;
+
+  void run() {
+    try {
+      bool more = true;
+      while (more) {
+        std::vector<kv_record> batch;
+        batch.reserve(batch_size);
+        kv_record r;
+        while ((batch.size() < batch_size) && (more = (*m_raw_reader)(r))) {
+          batch.push_back(std::move(r));
+        }
+
+        boost::unique_lock<boost::mutex> lock(m_mutex);
+        while ((m_batches.size() >= max_batches) && !m_stopped) {
+          m_cond.wait(lock);
+        }
+        if (m_stopped) { return; }
+        if (!batch.empty()) {
+          m_batches.push_back(std::vector<kv_record>());
+          std::swap(m_batches.back(), batch);
+        }
+        if (!more) { m_finished = true; }
+        m_cond.notify_all();
+      }
+
+    } catch (...) {
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      m_error = boost::current_exception();
+      m_finished = true;
+      m_cond.notify_all();
+    }
+  }
+
+  // reads and decodes the records when not reading ahead, or just reads
+  // them on the prefetch thread when reading ahead.
+  boost::scoped_ptr<db_reader<T> > m_reader;
+  boost::scoped_ptr<db_reader<kv_record> > m_raw_reader;
+  std::vector<kv_record> m_batch;
+  size_t m_pos;
+  // the record most recently returned by key(), until its value is decoded.
+  const kv_record *m_record;
+  std::deque<std::vector<kv_record> > m_batches;
+  bool m_finished, m_stopped;
+  boost::exception_ptr m_error;
+  boost::mutex m_mutex;
+  boost::condition_variable m_cond;
+  boost::scoped_ptr<boost::thread> m_thread;
+};
+
+template <>
+struct prefetch_reader<int> {
+  prefetch_reader(const std::string &, uint64_t, bool) {}
+};
+
+// blocks are cut at whichever comes first of a maximum number of elements
+// or an estimated size in bytes of the elements, tags and inners in them,
+// so that blocks of large relations or long tag lists don't blow up.
 template <typename T> struct block_size_trait { static const size_t value = 1048576; };
 template <> struct block_size_trait<relation> { static const size_t value =   65536; };
 
+const size_t max_block_bytes = 64 * 1048576;
+
+template <typename T> inline size_t approx_size(const T &) { return sizeof(T); }
+
+template <> inline size_t approx_size<current_tag>(const current_tag &t) { return sizeof(current_tag) + t.key.size() + t.value.size(); }
+template <> inline size_t approx_size<old_tag>(const old_tag &t) { return sizeof(old_tag) + t.key.size() + t.value.size(); }
+template <> inline size_t approx_size<relation_member>(const relation_member &rm) { return sizeof(relation_member) + rm.member_role.size(); }
+template <> inline size_t approx_size<changeset_comment>(const changeset_comment &cc) { return sizeof(changeset_comment) + cc.body.size(); }
+
+template <typename T>
+inline size_t approx_size(const std::vector<T> &vec, size_t begin) {
+  size_t size = 0;
+  for (size_t i = begin; i < vec.size(); ++i) {
+    size += approx_size<T>(vec[i]);
+  }
+  return size;
+}
+
 template <typename T> void zero_init(T &);
 template <typename T> int64_t id_of(const T &);
 
@@ -164,19 +644,22 @@ template <> inline int64_t version_of<current_tag>(const current_tag &t) { retur
 template <> inline int64_t version_of<changeset_comment>(const changeset_comment &) { return 0; }
 
 template <typename T>
-inline void fetch_associated(T &t, int64_t id, int64_t version, db_reader<T> &reader, std::vector<T> &vec) {
+inline void fetch_associated(T &t, int64_t id, int64_t version, prefetch_reader<T> &reader, std::vector<T> &vec) {
   while ((id_of<T>(t) < id) || ((id_of<T>(t) == id) && (version_of<T>(t) <= version))) {
     if ((id_of<T>(t) == id) && (version_of<T>(t) == version)) {
-      vec.push_back(t);
+      reader.value(t);
+      // the key fields are left intact by the move, which is all that's
+      // needed of t until the next record is read into it.
+      vec.push_back(std::move(t));
     }
-    if (!reader(t)) {
+    if (!reader.key(t)) {
       break;
     }
   }
 }
 
 template <>
-inline void fetch_associated<int>(int &, int64_t, int64_t, db_reader<int> &, std::vector<int> &) {
+inline void fetch_associated<int>(int &, int64_t, int64_t, prefetch_reader<int> &, std::vector<int> &) {
 }
 
 template <typename T>
@@ -184,23 +667,91 @@ inline bool is_redacted(const T &t) { return bool(t.redaction_id); }
 
 template <> inline bool is_redacted<changeset>(const changeset &) { return false; }
 
+/**
+ * options for how the elements are joined with their tags and inners.
+ */
+struct join_options {
+  unsigned int num_join_threads;
+  bool read_ahead, interleaved;
+
+  // resolves the users of elements for all the writers, or null if none
+  // of them want user info.
+  boost::shared_ptr<changeset_users> users;
+};
+
+// changesets record their users as they are joined, so that the users of
+// the elements joined later can be resolved from them.
 template <typename T>
-void extract_element(thread_writer<T> &writer) {
+inline void resolve_user(T &t, changeset_users *users) {
+  t.user = (users == NULL) ? NULL : users->find(t.changeset_id);
+}
+
+template <>
+inline void resolve_user<changeset>(changeset &cs, changeset_users *users) {
+  if (users != NULL) { users->insert(cs); }
+}
+
+/**
+ * accumulates joined elements, tags and inners into blocks for a writer,
+ * cutting them at whichever comes first of the maximum element count or
+ * byte budget.
+ */
+template <typename T, typename Writer>
+struct block_builder : private boost::noncopyable {
   typedef typename T::tag_type tag_type;
   typedef typename T::inner_type inner_type;
 
-  const size_t block_size = block_size_trait<T>::value;
+  block_builder(Writer &writer, changeset_users *users) : m_writer(writer), m_users(users), m_bytes(0) {}
+
+  // add an element, after its inners and tags have been appended to the
+  // block's vectors, which are counted towards the block's size from the
+  // given positions.
+  void add(T &element, size_t num_inners, size_t num_tags) {
+    resolve_user(element, m_users);
+    m_bytes += approx_size<T>(element) +
+      approx_size(inners, num_inners) + approx_size(tags, num_tags);
+
+    elements.push_back(T());
+    std::swap(elements.back(), element);
+
+    if ((elements.size() >= block_size_trait<T>::value) || (m_bytes >= max_block_bytes)) {
+      flush();
+    }
+  }
 
-  db_reader<T> element_reader(T::table_name());
-  db_reader<tag_type> tag_reader(T::tag_table_name());
-  db_reader<inner_type> inner_reader(T::inner_table_name());
+  void flush() {
+    if (!elements.empty()) {
+      m_writer.write(elements, inners, tags);
+      elements.clear();
+      inners.clear();
+      tags.clear();
+      m_bytes = 0;
+    }
+  }
 
   std::vector<T> elements;
   std::vector<tag_type> tags;
   std::vector<inner_type> inners;
 
-  elements.resize(block_size);
-  size_t i = 0;
+private:
+  Writer &m_writer;
+  changeset_users *m_users;
+  size_t m_bytes;
+};
+
+template <typename T, typename Writer>
+void extract_element(Writer &writer, const element_range &range, const join_options &opts) {
+  typedef typename T::tag_type tag_type;
+  typedef typename T::inner_type inner_type;
+
+  prefetch_reader<T> element_reader(T::table_name(), range.element_offset, opts.read_ahead);
+  prefetch_reader<tag_type> tag_reader(T::tag_table_name(), range.tag_offset, opts.read_ahead);
+  prefetch_reader<inner_type> inner_reader(T::inner_table_name(), range.inner_offset, opts.read_ahead);
+
+  block_builder<T, Writer> block(writer, opts.users.get());
+
+  T element;
+  uint64_t num_records = 0;
 
   tag_type current_tag;
   inner_type current_inner;
@@ -208,44 +759,207 @@ void extract_element(thread_writer<T> &writer) {
   zero_init<tag_type>(current_tag);
   zero_init<inner_type>(current_inner);
 
-  while (element_reader(elements[i])) {
+  while ((num_records < range.num_records) && element_reader(element)) {
+    ++num_records;
+
     // skip all redacted elements - they don't appear in the output
     // at all.
-    if (is_redacted<T>(elements[i])) { continue; }
+    if (is_redacted<T>(element)) { continue; }
 
     // skip all negative ID elements - these shouldn't appear in the
     // database at all.
-    if (elements[i].id < 0) { continue; }
+    if (element.id < 0) { continue; }
 
-    fetch_associated(current_inner, elements[i].id, version_of(elements[i]), inner_reader, inners);
-    fetch_associated(current_tag, elements[i].id, version_of(elements[i]), tag_reader, tags);
+    const size_t num_inners = block.inners.size(), num_tags = block.tags.size();
+    fetch_associated(current_inner, element.id, version_of(element), inner_reader, block.inners);
+    fetch_associated(current_tag, element.id, version_of(element), tag_reader, block.tags);
+    block.add(element, num_inners, num_tags);
+  }
 
-    ++i;
-    if (i == block_size) {
-      writer.write(elements, inners, tags);
-      inners.clear();
-      tags.clear();
-      i = 0;
-      if (elements.size() != block_size) { elements.resize(block_size); }
+  block.flush();
+}
+
+// the kinds of records in an interleaved database, which is the index of
+// the database they came from. see interleave_tables().
+enum record_kind {
+  record_kind_element = 0,
+  record_kind_inner = 1,
+  record_kind_tag = 2
+};
+
+template <typename I>
+inline void push_record(std::vector<I> &vec, const std::string &key, const kv_record &rec) {
+  vec.push_back(I());
+  insert_kv(vec.back(), key, rec.value);
+}
+
+template <>
+inline void push_record<int>(std::vector<int> &, const std::string &, const kv_record &) {
+  BOOST_THROW_EXCEPTION(std::runtime_error("Unexpected inner record in interleaved database."));
+}
+
+template <typename I>
+inline void append_moved(std::vector<I> &to, std::vector<I> &from) {
+  for (size_t i = 0; i < from.size(); ++i) {
+    to.push_back(std::move(from[i]));
+  }
+  from.clear();
+}
+
+/**
+ * like extract_element, but reading a database in which each element is
+ * already followed by its inners and tags, so a single sequential scan
+ * gives whole elements. a range starts at an arbitrary record, so any
+ * inners and tags before its first element belong to the previous range,
+ * which reads past its own end to finish its last element.
+ */
+template <typename T, typename Writer>
+void extract_interleaved(Writer &writer, const element_range &range, const join_options &opts) {
+  typedef typename T::tag_type tag_type;
+  typedef typename T::inner_type inner_type;
+
+  const size_t prefix_size = sizeof(int64_t) * T::num_keys;
+
+  prefetch_reader<kv_record> reader(T::interleaved_table_name(), range.element_offset, opts.read_ahead);
+
+  block_builder<T, Writer> block(writer, opts.users.get());
+
+  // the element whose inners and tags are being read, which is added to
+  // the block when the next element is reached.
+  T pending;
+  bool have_pending = false;
+  std::vector<tag_type> pending_tags;
+  std::vector<inner_type> pending_inners;
+
+  kv_record rec;
+  std::string key, pending_prefix;
+  uint64_t num_records = 0;
+
+  while (reader(rec)) {
+    ++num_records;
+    if (rec.key.size() <= prefix_size) {
+      BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Record key of %1% bytes in interleaved database is too short.") % rec.key.size()).str()));
+    }
+    const int kind = rec.key[prefix_size];
+    key.assign(rec.key, 0, prefix_size);
+    key.append(rec.key, prefix_size + 1, std::string::npos);
+
+    if (kind == record_kind_element) {
+      // the first element after the end of the range belongs to the next
+      // one, so isn't decoded here.
+      if (num_records > range.num_records) { break; }
+
+      T element;
+      insert_kv(element, key, rec.value);
+
+      if (have_pending) {
+        const size_t num_inners = block.inners.size(), num_tags = block.tags.size();
+        append_moved(block.inners, pending_inners);
+        append_moved(block.tags, pending_tags);
+        block.add(pending, num_inners, num_tags);
+        have_pending = false;
+      }
+
+      // skip redacted and negative ID elements along with their inners and
+      // tags, as in extract_element.
+      if (!is_redacted<T>(element) && (element.id >= 0)) {
+        std::swap(pending, element);
+        pending_prefix.assign(key, 0, prefix_size);
+        pending_inners.clear();
+        pending_tags.clear();
+        have_pending = true;
+      }
+
+    } else if (have_pending && (key.compare(0, prefix_size, pending_prefix) == 0)) {
+      if (kind == record_kind_inner) {
+        push_record(pending_inners, key, rec);
+
+      } else if (kind == record_kind_tag) {
+        push_record(pending_tags, key, rec);
+
+      } else {
+        BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unexpected record kind %1% in interleaved database.") % kind).str()));
+      }
     }
   }
 
-  elements.resize(i);
-  writer.write(elements, inners, tags);
+  if (have_pending) {
+    const size_t num_inners = block.inners.size(), num_tags = block.tags.size();
+    append_moved(block.inners, pending_inners);
+    append_moved(block.tags, pending_tags);
+    block.add(pending, num_inners, num_tags);
+  }
+
+  block.flush();
 }
 
-template <typename T> void write_elements(output_writer &writer, control_block<T> &blk);
+template <typename T, typename Writer>
+void extract_range(Writer &writer, const element_range &range, const join_options &opts) {
+  if (opts.interleaved) {
+    extract_interleaved<T>(writer, range, opts);
+  } else {
+    extract_element<T>(writer, range, opts);
+  }
+}
 
-template <> inline void write_elements<changeset>(output_writer &writer, control_block<changeset> &blk) {
+template <typename T>
+void join_worker(element_range range, const join_options &opts, boost::shared_ptr<block_queue<T> > queue) {
+  try {
+    extract_range<T>(*queue, range, opts);
+    queue->finish(boost::exception_ptr());
+
+  } catch (...) {
+    queue->finish(boost::current_exception());
+  }
+}
+
+/**
+ * join the elements with their tags and inners, writing blocks to the
+ * writer threads. the join is split by ranges of id over several worker
+ * threads, and the blocks from each are passed on in order.
+ */
+template <typename T>
+void extract_elements(thread_writer<T> &writer, const join_options &opts) {
+  const std::vector<element_range> ranges = element_ranges<T>(opts.num_join_threads, opts.interleaved);
+
+  if (ranges.size() == 1) {
+    extract_range<T>(writer, ranges[0], opts);
+
+  } else {
+    std::vector<boost::shared_ptr<block_queue<T> > > queues;
+    boost::thread_group workers;
+
+    BOOST_FOREACH(const element_range &range, ranges) {
+      boost::shared_ptr<block_queue<T> > queue = boost::make_shared<block_queue<T> >(1);
+      queues.push_back(queue);
+      workers.create_thread(boost::bind(&join_worker<T>, range, opts, queue));
+    }
+
+    BOOST_FOREACH(boost::shared_ptr<block_queue<T> > queue, queues) {
+      boost::shared_ptr<element_block<T> > block;
+      while ((block = queue->pop())) {
+        writer.write(block);
+      }
+    }
+
+    workers.join_all();
+  }
+
+  writer.finish();
+}
+
+template <typename T> void write_elements(output_writer &writer, const element_block<T> &blk);
+
+template <> inline void write_elements<changeset>(output_writer &writer, const element_block<changeset> &blk) {
   writer.changesets(blk.elements, blk.tags, blk.inners);
 }
-template <> inline void write_elements<node>(output_writer &writer, control_block<node> &blk) { 
+template <> inline void write_elements<node>(output_writer &writer, const element_block<node> &blk) { 
   writer.nodes(blk.elements, blk.tags);
 }
-template <> inline void write_elements<way>(output_writer &writer, control_block<way> &blk) { 
+template <> inline void write_elements<way>(output_writer &writer, const element_block<way> &blk) { 
   writer.ways(blk.elements, blk.inners, blk.tags);
 }
-template <> inline void write_elements<relation>(output_writer &writer, control_block<relation> &blk) { 
+template <> inline void write_elements<relation>(output_writer &writer, const element_block<relation> &blk) { 
   writer.relations(blk.elements, blk.inners, blk.tags);
 }
 
@@ -254,12 +968,13 @@ void writer_thread(int thread_index,
                    boost::exception_ptr exc,
                    boost::shared_ptr<output_writer> writer,
                    boost::shared_ptr<control_block<T> > blk) {
-  const size_t block_size = block_size_trait<T>::value;
+  // the reader thread is index 0, so writers start from 1.
+  const size_t reader_index = thread_index - 1;
 
-  do {
+  while (true) {
+    boost::shared_ptr<const element_block<T> > block;
     try {
-      blk->pre_swap_barrier.wait();
-      blk->post_swap_barrier.wait();
+      block = blk->blocks.next(reader_index);
     } catch (...) {
       exc = boost::current_exception();
       std::cerr << "EXCEPTION: writer_thread(" << thread_index << "): "
@@ -270,12 +985,15 @@ void writer_thread(int thread_index,
       abort();
     }
 
+    // a null block means there are no more.
+    if (!block) { break; }
+
     try {
       // if write_elements previously threw an exception, then don't call it
-      // again. but we need to continue going through the barrier loops, or all
-      // the other threads will lock up waiting for this thread.
+      // again. but we need to continue reading through the blocks, or the
+      // reader will eventually block waiting for this thread.
       if (exc == boost::exception_ptr()) {
-        write_elements<T>(*writer, *blk);
+        write_elements<T>(*writer, *block);
       }
 
     } catch (...) {
@@ -285,7 +1003,7 @@ void writer_thread(int thread_index,
                 << ". Trying to continue..."
                 << std::endl;
     }
-  } while (blk->elements.size() == block_size);
+  }
 
   try {
     boost::lock_guard<boost::mutex> lock(blk->thread_finished_mutex);
@@ -312,8 +1030,8 @@ void join_all_but(size_t i, std::vector<boost::shared_ptr<boost::thread> > &thre
       if ((j != i) && threads[j]->joinable()) {
         // if the thread isn't ready to join for a second, then it is probably blocked
         // on something - this is the exceptional path, so the likely case is that some
-        // thread has thrown an exception and the rest are waiting for it at the
-        // barrier.
+        // thread has thrown an exception and the rest are waiting for it on the
+        // block ring.
         if (!threads[j]->timed_join(boost::posix_time::time_duration(0, 0, 1))) {
           still_running = true;
           threads[j]->interrupt();
@@ -325,24 +1043,29 @@ void join_all_but(size_t i, std::vector<boost::shared_ptr<boost::thread> > &thre
 
 } // anonymous namespace
 
-void extract_users(std::map<int64_t, std::string> &display_name_map) {
-  db_reader<user> reader("users");
+boost::shared_ptr<const user_index> extract_users() {
+  boost::shared_ptr<user_index> index = boost::make_shared<user_index>();
+  db_reader<user> reader("users", 0);
   user u;
-  display_name_map.clear();
+  // the users database is sorted by ID, which is the order the index
+  // needs them in.
   while (reader(u)) {
     if (u.data_public) {
-      display_name_map.insert(std::make_pair(u.id, u.display_name));
+      index->push_back(u.id, u.display_name);
     }
   }
+  index->finish();
+  return index;
 }
 
 template <typename T>
 void reader_thread(int thread_index,
                    boost::exception_ptr exc,
-                   boost::shared_ptr<control_block<T> > blk) {
+                   boost::shared_ptr<control_block<T> > blk,
+                   join_options opts) {
   try {
     thread_writer<T> writer(blk);
-    extract_element<T>(writer);
+    extract_elements<T>(writer, opts);
 
   } catch (...) {
     exc = boost::current_exception();
@@ -369,17 +1092,46 @@ void reader_thread(int thread_index,
   }
 }
 
+namespace {
+
+template <typename T> inline bool writer_wants(const output_writer &) { return true; }
+
+template <> inline bool writer_wants<node>(const output_writer &w)     { return w.wants(nwr_node); }
+template <> inline bool writer_wants<way>(const output_writer &w)      { return w.wants(nwr_way); }
+template <> inline bool writer_wants<relation>(const output_writer &w) { return w.wants(nwr_relation); }
+
+} // anonymous namespace
+
 template <typename T>
-void run_threads(std::vector<boost::shared_ptr<output_writer> > writers) {
+void run_threads(std::vector<boost::shared_ptr<output_writer> > all_writers,
+                 const boost::program_options::variables_map &options,
+                 boost::shared_ptr<changeset_users> users) {
+  // writers which ignore this type of element are left out, and nothing is
+  // read at all if none of them want it.
+  std::vector<boost::shared_ptr<output_writer> > writers;
+  BOOST_FOREACH(boost::shared_ptr<output_writer> writer, all_writers) {
+    if (writer_wants<T>(*writer)) {
+      writers.push_back(writer);
+    }
+  }
+  if (writers.empty()) { return; }
+
   std::vector<boost::shared_ptr<boost::thread> > threads;
   std::vector<boost::exception_ptr> exceptions;
   const int num_threads = writers.size() + 1;
   int i = 0, num_running_threads = num_threads;
+  const unsigned int max_queued_blocks = options["max-queued-blocks"].as<unsigned int>();
+
+  join_options opts;
+  opts.num_join_threads = options["join-threads"].as<unsigned int>();
+  opts.read_ahead = options["read-ahead"].as<bool>();
+  opts.interleaved = options["interleave"].as<bool>();
+  opts.users = users;
 
   exceptions.resize(num_threads);
-  boost::shared_ptr<control_block<T> > blk = boost::make_shared<control_block<T> >(writers.size() + 1);
+  boost::shared_ptr<control_block<T> > blk = boost::make_shared<control_block<T> >(writers.size(), max_queued_blocks);
 
-  threads.push_back(boost::make_shared<boost::thread>(boost::bind(&reader_thread<T>, i, exceptions[i], blk)));
+  threads.push_back(boost::make_shared<boost::thread>(boost::bind(&reader_thread<T>, i, exceptions[i], blk, opts)));
 
   BOOST_FOREACH(boost::shared_ptr<output_writer> writer, writers) {
     ++i;
@@ -414,7 +1166,59 @@ void run_threads(std::vector<boost::shared_ptr<output_writer> > writers) {
   }
 }
 
-template void run_threads<node>(std::vector<boost::shared_ptr<output_writer> >);
-template void run_threads<way>(std::vector<boost::shared_ptr<output_writer> >);
-template void run_threads<relation>(std::vector<boost::shared_ptr<output_writer> >);
-template void run_threads<changeset>(std::vector<boost::shared_ptr<output_writer> >);
+namespace {
+
+template <typename T>
+void section_thread(std::vector<boost::shared_ptr<output_writer> > sections,
+                    const boost::program_options::variables_map &options,
+                    boost::shared_ptr<changeset_users> users,
+                    boost::exception_ptr &error) {
+  try {
+    if (!sections.empty()) {
+      run_threads<T>(sections, options, users);
+    }
+    BOOST_FOREACH(boost::shared_ptr<output_writer> section, sections) {
+      section->finish();
+    }
+
+  } catch (...) {
+    error = boost::current_exception();
+  }
+}
+
+std::vector<boost::shared_ptr<output_writer> >
+sections_of(const std::vector<boost::shared_ptr<output_writer> > &writers, nwr_enum type) {
+  std::vector<boost::shared_ptr<output_writer> > sections;
+  BOOST_FOREACH(boost::shared_ptr<output_writer> writer, writers) {
+    boost::shared_ptr<output_writer> section = writer->section(type);
+    if (section) {
+      sections.push_back(section);
+    }
+  }
+  return sections;
+}
+
+} // anonymous namespace
+
+void run_sections(std::vector<boost::shared_ptr<output_writer> > writers,
+                  const boost::program_options::variables_map &options,
+                  boost::shared_ptr<changeset_users> users) {
+  boost::exception_ptr node_error, way_error, relation_error;
+
+  boost::thread node_thread(&section_thread<node>, sections_of(writers, nwr_node), boost::cref(options), users, boost::ref(node_error));
+  boost::thread way_thread(&section_thread<way>, sections_of(writers, nwr_way), boost::cref(options), users, boost::ref(way_error));
+  boost::thread relation_thread(&section_thread<relation>, sections_of(writers, nwr_relation), boost::cref(options), users, boost::ref(relation_error));
+
+  node_thread.join();
+  way_thread.join();
+  relation_thread.join();
+
+  if (node_error) { boost::rethrow_exception(node_error); }
+  if (way_error) { boost::rethrow_exception(way_error); }
+  if (relation_error) { boost::rethrow_exception(relation_error); }
+}
+
+template void run_threads<node>(std::vector<boost::shared_ptr<output_writer> >, const boost::program_options::variables_map &, boost::shared_ptr<changeset_users>);
+template void run_threads<way>(std::vector<boost::shared_ptr<output_writer> >, const boost::program_options::variables_map &, boost::shared_ptr<changeset_users>);
+template void run_threads<relation>(std::vector<boost::shared_ptr<output_writer> >, const boost::program_options::variables_map &, boost::shared_ptr<changeset_users>);
+template void run_threads<changeset>(std::vector<boost::shared_ptr<output_writer> >, const boost::program_options::variables_map &, boost::shared_ptr<changeset_users>);
@@ -0,0 +1,25 @@
+#include "current_versions.hpp"
+#include "config.h"
+
+current_versions::current_versions(const std::string &element_table)
+  : m_element_table(element_table), m_finished(false) {
+}
+
+const std::string &current_versions::element_table() const {
+  return m_element_table;
+}
+
+void current_versions::finish() {
+  boost::lock_guard<boost::mutex> lock(m_mutex);
+  if (!m_finished) {
+    m_finished = true;
+    m_cond.notify_all();
+  }
+}
+
+void current_versions::wait() const {
+  boost::unique_lock<boost::mutex> lock(m_mutex);
+  while (!m_finished) {
+    m_cond.wait(lock);
+  }
+}
@@ -1,5 +1,7 @@
 #include "dump_archive.hpp"
+#include "dump_reader.hpp"
 #include "table_extractor.hpp"
+#include "current_versions.hpp"
 #include "types.hpp"
 
 #include <string>
@@ -25,25 +27,97 @@ namespace {
 struct tag_table_name;
 typedef boost::error_info<tag_table_name, std::string> errinfo_table_name;
 
+// rows are timestamped before their transaction commits, so rows with
+// timestamps a little before the previous run's latest one might not have
+// been in its dump. these are extracted again, and the duplicates dropped
+// when merging with the previous database.
+#define INCREMENTAL_OVERLAP_HOURS (24)
+
+// the second line of the .complete marker of a database which has only the
+// current versions of elements, rather than all of their history.
+#define CURRENT_ONLY_MARKER "current"
+
+bt::ptime read_complete_timestamp(const fs::path &base_dir) {
+  std::string timestamp_str;
+  fs::ifstream in(base_dir / ".complete");
+  std::getline(in, timestamp_str);
+  if (timestamp_str == "-infinity") {
+    return bt::ptime(bt::neg_infin);
+  } else {
+    return bt::time_from_string(timestamp_str);
+  }
+}
+
+bool read_complete_current_only(const fs::path &base_dir) {
+  std::string timestamp_str, mode;
+  fs::ifstream in(base_dir / ".complete");
+  std::getline(in, timestamp_str);
+  std::getline(in, mode);
+  return mode == CURRENT_ONLY_MARKER;
+}
+
+/**
+ * the sets which an element table shares with its tag and inner tables,
+ * any of which may be null. see run_thread.
+ */
+struct element_sets {
+  boost::shared_ptr<version_set> redactions, new_versions;
+  boost::shared_ptr<current_versions> current;
+};
+
+// the previous run of the table, or null if not extracting incrementally.
+template <typename R>
+boost::shared_ptr<const previous_run> previous_run_of(const std::string &table_name,
+                                                      const std::string &previous_dir,
+                                                      const element_sets &sets) {
+  boost::shared_ptr<previous_run> previous;
+  if (previous_dir.empty() || !sets.new_versions) {
+    return previous;
+  }
+
+  fs::path subdir = fs::path(previous_dir) / table_name;
+  if (!fs::exists(subdir / ".complete")) {
+    BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Previous database '%1%' is not complete.") % subdir.string()).str()));
+  }
+  // history can't be rebuilt on top of a database which doesn't have it.
+  if (!sets.current && read_complete_current_only(subdir)) {
+    BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Previous database '%1%' has only the current versions of elements, so can't be used for history outputs.") % subdir.string()).str()));
+  }
+
+  previous = boost::make_shared<previous_run>();
+  previous->subdir = subdir.string();
+  previous->new_versions = sets.new_versions;
+  // versions unredacted since the previous run are older than this, and
+  // weren't in its database, so they're missed. see the README.
+  if (records_redactions<R>::value) {
+    previous->since = read_complete_timestamp(subdir) - bt::hours(INCREMENTAL_OVERLAP_HOURS);
+  }
+  return previous;
+}
+
 template <typename R>
 bt::ptime extract_table_with_timestamp(const std::string &table_name, 
                                        const std::string &dump_file,
                                        bool resume,
-                                       unsigned int max_concurrency) {
+                                       unsigned int max_concurrency,
+                                       const std::string &previous_dir,
+                                       const element_sets &sets) {
   typedef R row_type;
   fs::path base_dir(table_name);
   boost::optional<bt::ptime> timestamp;
 
+  const boost::shared_ptr<version_set> &redactions = sets.redactions, &new_versions = sets.new_versions;
+  const bool records = redactions && records_redactions<R>::value;
+  const bool records_new = new_versions && records_redactions<R>::value;
+
+  // an element table can't be resumed incrementally unless it recorded its
+  // new versions, which its tag and inner tables need. a database with only
+  // current versions can't be resumed when history is wanted.
   if (fs::exists(base_dir)) {
-    if (fs::is_directory(base_dir) && fs::exists(base_dir / ".complete") && resume) {
-      std::string timestamp_str;
-      fs::ifstream in(base_dir / ".complete");
-      std::getline(in, timestamp_str);
-      if (timestamp_str == "-infinity") {
-        timestamp = bt::ptime(bt::neg_infin);
-      } else {
-        timestamp = bt::time_from_string(timestamp_str);
-      }
+    if (fs::is_directory(base_dir) && fs::exists(base_dir / ".complete") && resume &&
+        (!records_new || fs::exists(base_dir / "new_versions")) &&
+        (sets.current || !read_complete_current_only(base_dir))) {
+      timestamp = read_complete_timestamp(base_dir);
 
     } else {
       fs::remove_all(base_dir);
@@ -51,13 +125,30 @@ bt::ptime extract_table_with_timestamp(const std::string &table_name,
   }
 
   if (timestamp) {
+    if (records) {
+      redactions->load((base_dir / "redactions").string());
+    }
+    if (records_new) {
+      new_versions->load((base_dir / "new_versions").string());
+    }
     return timestamp.get();
 
   } else {
-    table_extractor_with_timestamp<row_type> extractor(table_name, dump_file, max_concurrency);
+    table_extractor_with_timestamp<row_type> extractor(table_name, dump_file, max_concurrency, redactions,
+                                                       previous_run_of<R>(table_name, previous_dir, sets),
+                                                       sets.current);
     timestamp = extractor.read();
+    if (records) {
+      redactions->save((base_dir / "redactions").string());
+    }
+    if (records_new) {
+      new_versions->save((base_dir / "new_versions").string());
+    }
     fs::ofstream out(base_dir / ".complete");
     out << bt::to_simple_string(timestamp.get()) << "\n";
+    if (sets.current) {
+      out << CURRENT_ONLY_MARKER << "\n";
+    }
     return timestamp.get();
   }
 }
@@ -68,9 +159,12 @@ void thread_extract_with_timestamp(bt::ptime &timestamp,
                                    std::string table_name,
                                    std::string dump_file,
                                    bool resume,
-                                   unsigned int max_concurrency) {
+                                   unsigned int max_concurrency,
+                                   std::string previous_dir,
+                                   element_sets sets) {
   try {
-    bt::ptime ts = extract_table_with_timestamp<R>(table_name, dump_file, resume, max_concurrency);
+    bt::ptime ts = extract_table_with_timestamp<R>(table_name, dump_file, resume, max_concurrency,
+                                                   previous_dir, sets);
     timestamp = ts;
 
   } catch (const boost::exception &e) {
@@ -85,6 +179,37 @@ void thread_extract_with_timestamp(bt::ptime &timestamp,
               << ", " << dump_file << ")!" << std::endl;
     abort();
   }
+
+  // release the tag and inner tables waiting on the redactions, even if
+  // this table failed, so that they don't wait forever.
+  if (sets.redactions && records_redactions<R>::value) {
+    sets.redactions->finish();
+  }
+  if (sets.new_versions && records_redactions<R>::value) {
+    sets.new_versions->finish();
+  }
+  if (sets.current && records_redactions<R>::value) {
+    sets.current->finish();
+  }
+}
+
+element_sets make_element_sets(boost::shared_ptr<version_set> redactions,
+                               boost::shared_ptr<version_set> new_versions,
+                               boost::shared_ptr<current_versions> current) {
+  element_sets sets;
+  sets.redactions = redactions;
+  sets.new_versions = new_versions;
+  sets.current = current;
+  return sets;
+}
+
+// the time at which a database was completed, or nothing if it isn't.
+boost::optional<std::time_t> completed_at(const fs::path &base_dir) {
+  boost::optional<std::time_t> time;
+  if (fs::exists(base_dir / ".complete")) {
+    time = fs::last_write_time(base_dir / ".complete");
+  }
+  return time;
 }
 
 } // anonymous namespace
@@ -92,11 +217,16 @@ void thread_extract_with_timestamp(bt::ptime &timestamp,
 base_thread::~base_thread() {}
 
 template <typename R>
-run_thread<R>::run_thread(std::string table_name_, std::string dump_file, bool resume, unsigned int max_concurrency)
+run_thread<R>::run_thread(std::string table_name_, std::string dump_file, bool resume, unsigned int max_concurrency,
+                          boost::shared_ptr<version_set> redactions,
+                          std::string previous_dir,
+                          boost::shared_ptr<version_set> new_versions,
+                          boost::shared_ptr<current_versions> current)
   : timestamp(), error(), 
     thr(&thread_extract_with_timestamp<R>,
         boost::ref(timestamp), boost::ref(error),
-        table_name_, dump_file, resume, max_concurrency), table_name(table_name_) {
+        table_name_, dump_file, resume, max_concurrency,
+        previous_dir, make_element_sets(redactions, new_versions, current)), table_name(table_name_) {
 }
 
 template <typename R>
@@ -118,6 +248,39 @@ bt::ptime run_thread<R>::join() {
   return timestamp;
 }
 
+template <typename T>
+void interleave_tables(bool resume) {
+  fs::path base_dir(T::interleaved_table_name());
+  std::vector<std::string> sources;
+  sources.push_back(T::table_name());
+  sources.push_back(T::inner_table_name());
+  sources.push_back(T::tag_table_name());
+
+  if (fs::exists(base_dir)) {
+    boost::optional<std::time_t> completed = completed_at(base_dir);
+    bool up_to_date = resume && bool(completed);
+    BOOST_FOREACH(const std::string &source, sources) {
+      if (source.empty()) { continue; }
+      boost::optional<std::time_t> source_completed = completed_at(fs::path(source));
+      if (!source_completed || !completed || (source_completed.get() > completed.get())) {
+        up_to_date = false;
+      }
+    }
+    if (up_to_date) { return; }
+
+    fs::remove_all(base_dir);
+  }
+
+  interleave_databases(base_dir.string(), sources, sizeof(int64_t) * T::num_keys);
+  fs::ofstream out(base_dir / ".complete");
+  out << "interleaved\n";
+}
+
+template void interleave_tables<changeset>(bool);
+template void interleave_tables<node>(bool);
+template void interleave_tables<way>(bool);
+template void interleave_tables<relation>(bool);
+
 template struct run_thread<user>;
 template struct run_thread<changeset>;
 template struct run_thread<current_tag>;
@@ -3,6 +3,7 @@
 
 #include <cstdio>
 #include <limits>
+#include <map>
 #include <boost/algorithm/string.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/format.hpp>
@@ -302,9 +303,23 @@ private:
   kv_pair_t m_current;
 };
 
+// the data files are written as a series of gzip members, each starting
+// after roughly this many bytes of uncompressed data. the index file which
+// goes alongside each data file has an entry for each member, so that
+// readers can start from the member containing a particular key without
+// decompressing everything before it.
+#define INDEX_SEGMENT_SIZE (1048576)
+
+std::string index_file_name(const std::string &data_file_name) {
+  return fs::path(data_file_name).replace_extension(".index").string();
+}
+
 struct block_writer : public boost::noncopyable {
   block_writer(const std::string &subdir, const std::string &bit, size_t block_counter)
-    : m_anything_written(false) {
+    : m_anything_written(false),
+      m_segment_offset(0),
+      m_segment_records(0),
+      m_segment_bytes(0) {
     m_file_name = (boost::format("%1$s/%2$s_%3$08x.data") % subdir % bit % block_counter).str();
     if (fs::exists(m_file_name)) {
       fs::remove(m_file_name);
@@ -317,8 +332,15 @@ struct block_writer : public boost::noncopyable {
       BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("File '%1%' is open, but not good.") % m_file_name).str()));
     }
 
-    m_stream.push(bio::gzip_compressor(1));
-    m_stream.push(m_out);
+    const std::string index_name = index_file_name(m_file_name);
+    m_index.open(index_name.c_str());
+    if (!m_index.is_open()) {
+      BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unable to open '%1%'.") % index_name).str()));
+    }
+
+    // the first segment is keyed by the empty string, which sorts before
+    // any other key.
+    start_segment(std::string());
 
     // TODO: future optimisation
     // int fd = (m_out.rdbuf())->fd();
@@ -329,9 +351,9 @@ struct block_writer : public boost::noncopyable {
   }
 
   ~block_writer() {
-    bio::flush(m_stream);
-    bio::close(m_stream);
+    end_segment();
     m_out.close();
+    m_index.close();
   }
 
   inline void operator()(const kv_pair_t &kv) {
@@ -339,6 +361,11 @@ struct block_writer : public boost::noncopyable {
     const std::string &k = kv.first;
     const std::string &v = kv.second;
 
+    if (m_segment_bytes >= INDEX_SEGMENT_SIZE) {
+      end_segment();
+      start_segment(k);
+    }
+
     uint16_t key_size = 0, val_size = 0;
     uint64_t key_extra_size = 0, val_extra_size = 0;
 
@@ -356,24 +383,59 @@ struct block_writer : public boost::noncopyable {
       val_size = uint16_t(v.size());
     }
 
-    bio::write(m_stream, (const char *)(&key_size), sizeof(uint16_t));
+    bio::write(*m_stream, (const char *)(&key_size), sizeof(uint16_t));
     if (key_extra_size > 0) {
-      bio::write(m_stream, (const char *)(&key_extra_size), sizeof(uint64_t));
+      bio::write(*m_stream, (const char *)(&key_extra_size), sizeof(uint64_t));
     }
-    bio::write(m_stream, (const char *)(&val_size), sizeof(uint16_t));
+    bio::write(*m_stream, (const char *)(&val_size), sizeof(uint16_t));
     if (val_extra_size > 0) {
-      bio::write(m_stream, (const char *)(&val_extra_size), sizeof(uint64_t));
+      bio::write(*m_stream, (const char *)(&val_extra_size), sizeof(uint64_t));
     }
-    bio::write(m_stream, k.c_str(), k.size());
-    bio::write(m_stream, v.c_str(), v.size());
+    bio::write(*m_stream, k.c_str(), k.size());
+    bio::write(*m_stream, v.c_str(), v.size());
     m_anything_written = true;
+
+    ++m_segment_records;
+    m_segment_bytes += k.size() + v.size();
   }
 
 private:
+  void start_segment(const std::string &first_key) {
+    m_segment_offset = uint64_t(m_out.tellp());
+    m_segment_key = first_key;
+    m_segment_records = 0;
+    m_segment_bytes = 0;
+
+    m_stream.reset(new bio::filtering_streambuf<bio::output>());
+    m_stream->push(bio::gzip_compressor(1));
+    m_stream->push(m_out);
+  }
+
+  // finish the gzip member for this segment and write its index entry,
+  // which is the offset of the member, the number of records in it and
+  // the key of the first record.
+  void end_segment() {
+    bio::flush(*m_stream);
+    bio::close(*m_stream);
+    m_stream.reset();
+
+    const uint32_t key_size = m_segment_key.size();
+    m_index.write((const char *)(&m_segment_offset), sizeof(uint64_t));
+    m_index.write((const char *)(&m_segment_records), sizeof(uint64_t));
+    m_index.write((const char *)(&key_size), sizeof(uint32_t));
+    m_index.write(m_segment_key.data(), key_size);
+    if (!m_index.good()) {
+      BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unable to write index for '%1%'.") % m_file_name).str()));
+    }
+  }
+
   bool m_anything_written;
   std::string m_file_name;
-  std::ofstream m_out;
-  bio::filtering_streambuf<bio::output> m_stream;
+  std::ofstream m_out, m_index;
+  boost::scoped_ptr<bio::filtering_streambuf<bio::output> > m_stream;
+  uint64_t m_segment_offset, m_segment_records;
+  size_t m_segment_bytes;
+  std::string m_segment_key;
 };
 
 struct compare_first {
@@ -389,12 +451,90 @@ struct compare_first {
   }
 };
 
+// the keys of element records are their id and version, and the keys of
+// their tag and inner records start with the same.
+#define ELEMENT_ID_SIZE (sizeof(int64_t))
+#define ELEMENT_VERSION_SIZE (2 * sizeof(int64_t))
+
+/**
+ * passes the records given to it, in key order, on to the sink, but only
+ * those of current versions as selected by the filter. an element record is
+ * held back until the next one, or flush(), shows whether it's the last
+ * version of its element.
+ */
+template <typename Sink>
+struct current_selector : public boost::noncopyable {
+  current_selector(Sink &sink, const dump_reader::current_filter &filter)
+    : m_sink(sink), m_filter(filter), m_have_pending(false) {
+    if (!m_filter.elements_subdir.empty()) {
+      m_elements.reset(new block_reader(m_filter.elements_subdir, "final", 0));
+    }
+  }
+
+  void operator()(const kv_pair_t &kv) {
+    if (m_filter.deleted) {
+      if (m_have_pending && (kv.first.compare(0, ELEMENT_ID_SIZE, m_pending.first, 0, ELEMENT_ID_SIZE) != 0)) {
+        flush();
+      }
+      m_pending = kv;
+      m_have_pending = true;
+
+    } else if (!m_elements || is_current(kv.first)) {
+      m_sink(kv);
+    }
+  }
+
+  void flush() {
+    if (m_have_pending) {
+      if (!m_filter.deleted(m_pending.first, m_pending.second)) {
+        m_sink(m_pending);
+      }
+      m_have_pending = false;
+    }
+  }
+
+private:
+  // whether the key belongs to a version in the element table. the keys
+  // are given in order, so the element table is read alongside them.
+  bool is_current(const std::string &key) {
+    while (!m_elements->at_end() &&
+           (m_elements->value().first.compare(0, ELEMENT_VERSION_SIZE, key, 0, ELEMENT_VERSION_SIZE) < 0)) {
+      m_elements->next();
+    }
+    return !m_elements->at_end() &&
+      (m_elements->value().first.compare(0, ELEMENT_VERSION_SIZE, key, 0, ELEMENT_VERSION_SIZE) == 0);
+  }
+
+  Sink &m_sink;
+  const dump_reader::current_filter &m_filter;
+  boost::scoped_ptr<block_reader> m_elements;
+  bool m_have_pending;
+  kv_pair_t m_pending;
+};
+
+// whether the filter drops any records at all.
+inline bool selects_current(const dump_reader::current_filter &filter) {
+  return bool(filter.deleted) || !filter.elements_subdir.empty();
+}
+
+// appends records to a table kept in memory.
+struct memory_sink {
+  explicit memory_sink(memory_table_t &table) : m_table(table) {}
+  void operator()(const kv_pair_t &kv) { m_table.push_back(kv); }
+
+private:
+  memory_table_t &m_table;
+};
+
 struct thread_control_block : public boost::noncopyable {
   sem_t *m_sem;
   std::string m_subdir, m_prefix;
   size_t m_block_number;
   std::vector<kv_pair_t> m_strings;
   std::vector<boost::shared_ptr<thread_control_block> > m_waits;
+  dump_reader::key_filter m_drop;
+  std::string m_previous;
+  dump_reader::current_filter m_current;
   boost::shared_ptr<boost::thread> m_thread;
   boost::exception_ptr m_error;
 
@@ -402,9 +542,12 @@ struct thread_control_block : public boost::noncopyable {
                        std::string subdir, std::string prefix, size_t block_number,
                        std::vector<kv_pair_t> &strings,
                        std::vector<boost::shared_ptr<thread_control_block> > waits = 
-                       std::vector<boost::shared_ptr<thread_control_block> >())
+                       std::vector<boost::shared_ptr<thread_control_block> >(),
+                       dump_reader::key_filter drop = dump_reader::key_filter(),
+                       std::string previous = std::string(),
+                       dump_reader::current_filter current = dump_reader::current_filter())
     : m_sem(sem), m_subdir(subdir), m_prefix(prefix), m_block_number(block_number), m_strings(), m_waits(waits),
-      m_thread(), m_error() {
+      m_drop(drop), m_previous(previous), m_current(current), m_thread(), m_error() {
     std::swap(m_strings, strings);
     strings.clear();
 
@@ -430,7 +573,7 @@ struct thread_control_block : public boost::noncopyable {
     sum += sizeof(m_strings);
     std::cerr << "Starting thread with " << sum << " bytes" << std::endl;
     try {
-      if (tcb.m_waits.size() > 0) {
+      if ((tcb.m_waits.size() > 0) || !tcb.m_previous.empty()) {
         tcb.run_merge();
 
       } else {
@@ -448,7 +591,9 @@ struct thread_control_block : public boost::noncopyable {
   }
 
   void run_merge() {
-    if (m_waits.size() == 1) {
+    // a single block can just be renamed, unless records need dropping or
+    // merging with a previous database.
+    if ((m_waits.size() == 1) && !m_drop && m_previous.empty() && !selects_current(m_current)) {
       // wait for only thread to finish
       thread_control_block &tcb2 = *(m_waits[0]);
       tcb2.m_thread->join();
@@ -458,6 +603,7 @@ struct thread_control_block : public boost::noncopyable {
       std::string part_file_name = tcb2.file_name();
       std::string final_file_name = file_name();
       fs::rename(part_file_name, final_file_name);
+      fs::rename(index_file_name(part_file_name), index_file_name(final_file_name));
       return;
     }
     
@@ -468,9 +614,26 @@ struct thread_control_block : public boost::noncopyable {
       readers.push_back(new block_reader(tcb2->m_subdir, tcb2->m_prefix, tcb2->m_block_number));
     }
     m_waits.clear();
+
+    // the previous database goes last, so that records from the dump are
+    // chosen first when keys are equal, and the duplicates then skipped.
+    // unlike the parts, it's left in place after it's been read.
+    block_reader *previous = NULL;
+    if (!m_previous.empty()) {
+      previous = new block_reader(m_previous, "final", 0);
+      if (previous->at_end()) {
+        delete previous;
+        previous = NULL;
+      } else {
+        readers.push_back(previous);
+      }
+    }
+    std::string last_key;
+    bool written_any = false;
     
     compare_first comp;
     block_writer writer(m_subdir, m_prefix, m_block_number);
+    current_selector<block_writer> select(writer, m_current);
     while (!readers.empty()) {
       std::list<block_reader*>::iterator min_itr = readers.begin();
       kv_pair_t min_pair = (*min_itr)->value();
@@ -479,33 +642,50 @@ struct thread_control_block : public boost::noncopyable {
       ++itr;
       while (itr != readers.end()) {
         const kv_pair_t &val = (*itr)->value();
-        if (comp(val, min_pair)) {
+        // compare_first is true for equal keys too, so the earlier reader
+        // is only replaced by one whose key is strictly less.
+        if (comp(val, min_pair) && (val.first != min_pair.first)) {
           min_pair = val;
           min_itr = itr;
         }
         ++itr;
       }
       
-      writer(min_pair);
+      const bool duplicate = !m_previous.empty() && written_any && (min_pair.first == last_key);
+      if (!duplicate && (!m_drop || !m_drop(min_pair.first))) {
+        select(min_pair);
+      }
+      if (!m_previous.empty()) {
+        last_key = min_pair.first;
+        written_any = true;
+      }
       
       (*min_itr)->next();
       if ((*min_itr)->at_end()) {
-        fs::remove((*min_itr)->file_name());
+        if (*min_itr != previous) {
+          fs::remove((*min_itr)->file_name());
+          fs::remove(index_file_name((*min_itr)->file_name()));
+        }
         delete *min_itr;
         readers.erase(min_itr);
       }
     }
+    select.flush();
   }
 
   void run_write() {
     block_writer writer(m_subdir, m_prefix, m_block_number);
+    current_selector<block_writer> select(writer, m_current);
     compare_first comp;
 
     std::sort(m_strings.begin(), m_strings.end(), comp);
 
     BOOST_FOREACH(const kv_pair_t &kv, m_strings) {
-      writer(kv);
+      if (!m_drop || !m_drop(kv.first)) {
+        select(kv);
+      }
     }
+    select.flush();
 
     // actually want to make sure m_strings is deallocated here, because we're
     // done using it and this thread owns that memory until the thread is joined
@@ -516,6 +696,10 @@ struct thread_control_block : public boost::noncopyable {
   }
 };
 
+// tables which were small enough to be kept in memory, by name.
+boost::mutex memory_tables_mutex;
+std::map<std::string, boost::shared_ptr<const memory_table_t> > memory_tables;
+
 struct db_writer : public boost::noncopyable {
   explicit db_writer(const std::string &table_name, unsigned int max_concurrency)
     : m_subdir(table_name),
@@ -560,11 +744,19 @@ struct db_writer : public boost::noncopyable {
     }
   }
   
-  void finish() {
+  void finish(const dump_reader::key_filter &drop, const std::string &previous,
+              const dump_reader::current_filter &current) {
+    // if nothing has been flushed yet then the whole table fits in a
+    // single block, and can be kept in memory.
+    if (previous.empty() && m_blocks.empty() && m_blocks2.empty() && m_blocks3.empty()) {
+      keep_in_memory(drop, current);
+      return;
+    }
+
     if (m_strings.size() > 0) {
       flush_block();
     }
-    combine_blocks();
+    combine_blocks(drop, previous, current);
   }
   
   void put(const std::string &k, const std::string &v) {
@@ -612,7 +804,47 @@ private:
     ++m_block_counter;
   }
 
-  void combine_blocks() {
+  void keep_in_memory(const dump_reader::key_filter &drop, const dump_reader::current_filter &current) {
+    boost::shared_ptr<memory_table_t> table = boost::make_shared<memory_table_t>();
+    std::sort(m_strings.begin(), m_strings.end(), compare_first());
+    if (selects_current(current)) {
+      memory_sink sink(*table);
+      current_selector<memory_sink> select(sink, current);
+      BOOST_FOREACH(const kv_pair_t &kv, m_strings) {
+        if (!drop || !drop(kv.first)) {
+          select(kv);
+        }
+      }
+      select.flush();
+      std::vector<kv_pair_t>().swap(m_strings);
+
+    } else if (drop) {
+      BOOST_FOREACH(kv_pair_t &kv, m_strings) {
+        if (!drop(kv.first)) {
+          table->push_back(kv_pair_t());
+          std::swap(table->back(), kv);
+        }
+      }
+      std::vector<kv_pair_t>().swap(m_strings);
+
+    } else {
+      std::swap(*table, m_strings);
+    }
+
+    // still write it out to disk, for resuming later.
+    {
+      block_writer writer(m_subdir, "final", 0);
+      BOOST_FOREACH(const kv_pair_t &kv, *table) {
+        writer(kv);
+      }
+    }
+
+    boost::lock_guard<boost::mutex> lock(memory_tables_mutex);
+    memory_tables[m_subdir] = table;
+  }
+
+  void combine_blocks(const dump_reader::key_filter &drop, const std::string &previous,
+                      const dump_reader::current_filter &current) {
     if (m_blocks2.size() > 0) {
       m_blocks.insert(m_blocks.end(), m_blocks2.begin(), m_blocks2.end());
       m_blocks2.clear();
@@ -621,15 +853,82 @@ private:
       m_blocks.insert(m_blocks.end(), m_blocks3.begin(), m_blocks3.end());
       m_blocks3.clear();
     }
-    thread_control_block tcb(&m_sem, m_subdir, "final", 0, m_strings, m_blocks);
+    thread_control_block tcb(&m_sem, m_subdir, "final", 0, m_strings, m_blocks, drop, previous, current);
     m_strings.clear();
     tcb.m_thread->join();
     if (tcb.m_error) { boost::rethrow_exception(tcb.m_error); }
   }
 };
 
+// key of a record in an interleaved database, which is the key of the
+// original record with the kind byte inserted after the element's prefix.
+void interleaved_key(const std::string &key, size_t prefix_size, char kind, std::string &out) {
+  if (key.size() < prefix_size) {
+    BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Key of %1% bytes is too short to interleave, expected at least %2%.") % key.size() % prefix_size).str()));
+  }
+  out.assign(key, 0, prefix_size);
+  out.push_back(kind);
+  out.append(key, prefix_size, std::string::npos);
+}
+
 } // anonymous namespace
 
+boost::shared_ptr<const memory_table_t> memory_table(const std::string &table_name) {
+  boost::lock_guard<boost::mutex> lock(memory_tables_mutex);
+  std::map<std::string, boost::shared_ptr<const memory_table_t> >::const_iterator itr = memory_tables.find(table_name);
+  if (itr == memory_tables.end()) {
+    return boost::shared_ptr<const memory_table_t>();
+  }
+  return itr->second;
+}
+
+void interleave_databases(const std::string &subdir,
+                          const std::vector<std::string> &sources,
+                          size_t prefix_size) {
+  std::vector<boost::shared_ptr<block_reader> > readers;
+  std::vector<kv_pair_t> heads;
+  std::vector<char> kinds;
+
+  for (size_t i = 0; i < sources.size(); ++i) {
+    if (sources[i].empty()) { continue; }
+    boost::shared_ptr<block_reader> reader = boost::make_shared<block_reader>(sources[i], "final", 0);
+    if (reader->at_end()) { continue; }
+
+    readers.push_back(reader);
+    kinds.push_back(char(i));
+    heads.push_back(kv_pair_t());
+    interleaved_key(reader->value().first, prefix_size, kinds.back(), heads.back().first);
+    heads.back().second = reader->value().second;
+  }
+
+  fs::create_directories(subdir);
+  compare_first comp;
+  block_writer writer(subdir, "final", 0);
+
+  while (!readers.empty()) {
+    size_t min_idx = 0;
+    for (size_t i = 1; i < readers.size(); ++i) {
+      if (comp(heads[i], heads[min_idx])) {
+        min_idx = i;
+      }
+    }
+
+    writer(heads[min_idx]);
+
+    block_reader &reader = *readers[min_idx];
+    reader.next();
+    if (reader.at_end()) {
+      readers.erase(readers.begin() + min_idx);
+      heads.erase(heads.begin() + min_idx);
+      kinds.erase(kinds.begin() + min_idx);
+
+    } else {
+      interleaved_key(reader.value().first, prefix_size, kinds[min_idx], heads[min_idx].first);
+      heads[min_idx].second = reader.value().second;
+    }
+  }
+}
+
 struct dump_reader::pimpl {
   pimpl(const std::string &cmd, const std::string &table_name, unsigned int max_concurrency)
     : m_proc(cmd),
@@ -678,5 +977,18 @@ void dump_reader::put(const std::string &k, const std::string &v) {
 }
 
 void dump_reader::finish() {
-  m_impl->m_writer.finish();
+  m_impl->m_writer.finish(key_filter(), std::string(), current_filter());
+}
+
+void dump_reader::finish(const key_filter &drop) {
+  m_impl->m_writer.finish(drop, std::string(), current_filter());
+}
+
+void dump_reader::finish(const key_filter &drop, const std::string &previous_subdir) {
+  m_impl->m_writer.finish(drop, previous_subdir, current_filter());
+}
+
+void dump_reader::finish(const key_filter &drop, const std::string &previous_subdir,
+                         const current_filter &current) {
+  m_impl->m_writer.finish(drop, previous_subdir, current);
 }
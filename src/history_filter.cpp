@@ -4,10 +4,66 @@
 #include "xml_writer.hpp"
 #include "pbf_writer.hpp"
 
+namespace {
+
+inline int64_t owner_id(const old_tag &t) { return t.element_id; }
+inline int64_t owner_id(const way_node &wn) { return wn.way_id; }
+inline int64_t owner_id(const relation_member &rm) { return rm.relation_id; }
+
+// copy the elements which are the maximum version for their ID, and
+// visible, apart from the last in the block, which might have more
+// versions in the next block.
+template <typename E>
+void current_versions(const std::vector<E> &es, std::vector<E> &out) {
+  for (size_t i = 1; i < es.size(); ++i) {
+    if ((es[i].id > es[i-1].id) && es[i-1].visible) {
+      out.push_back(es[i-1]);
+    }
+  }
+}
+
+// copy the tags or inners belonging to the given element, which is the
+// last in its block, so its items are all at the end of the block's items.
+template <typename E, typename I>
+void trailing_items_of(const E &e, const std::vector<I> &items, std::vector<I> &out) {
+  typename std::vector<I>::const_iterator itr = items.end();
+  while ((itr != items.begin()) && (owner_id(*(itr - 1)) == e.id) && ((itr - 1)->version >= e.version)) {
+    --itr;
+  }
+
+  out.clear();
+  for (; itr != items.end(); ++itr) {
+    if (itr->version == e.version) {
+      out.push_back(*itr);
+    }
+  }
+}
+
+} // anonymous namespace
+
 template <typename T>
 history_filter<T>::history_filter(const std::string &option_name, const boost::program_options::variables_map &options,
-                                  const user_map_t &user_map, const boost::posix_time::ptime &max_time, user_info_level uil, historical_versions hv, changeset_discussions cd)
-  : m_writer(new T(option_name, options, user_map, max_time, uil, historical_versions::NONE, cd)),
+                                  const user_index &users, const boost::posix_time::ptime &max_time, user_info_level uil, historical_versions, changeset_discussions cd)
+  // the filtered output never has history, whatever was asked for.
+  : m_writer(new T(option_name, options, users, max_time, uil, historical_versions::NONE, cd)),
+    m_left_over_nodes(boost::none),
+    m_left_over_ways(boost::none),
+    m_left_over_relations(boost::none) {
+}
+
+template <typename T>
+history_filter<T>::history_filter(const std::string &option_name, const std::string &anon_option_name,
+                                  const boost::program_options::variables_map &options,
+                                  const user_index &users, const boost::posix_time::ptime &max_time, historical_versions, changeset_discussions cd)
+  : m_writer(new T(option_name, anon_option_name, options, users, max_time, historical_versions::NONE, cd)),
+    m_left_over_nodes(boost::none),
+    m_left_over_ways(boost::none),
+    m_left_over_relations(boost::none) {
+}
+
+template <typename T>
+history_filter<T>::history_filter(boost::shared_ptr<output_writer> section_writer)
+  : m_writer(section_writer),
     m_left_over_nodes(boost::none),
     m_left_over_ways(boost::none),
     m_left_over_relations(boost::none) {
@@ -28,55 +84,29 @@ void history_filter<T>::changesets(const std::vector<changeset> &cs,
 
 template <typename T>
 void history_filter<T>::nodes(const std::vector<node> &ns, const std::vector<old_tag> &ts) {
-  std::vector<node> cn;
-  std::vector<old_tag> ct;
-
   // handle a left over node, but only if its version list doesn't continue into
   // this block - if it does, then we can ignore the left over one.
   if (m_left_over_nodes && (ns.empty() || (ns[0].id > m_left_over_nodes->n.id))) {
     if (m_left_over_nodes->n.visible) {
-      cn.push_back(m_left_over_nodes->n);
-      std::swap(m_left_over_nodes->tags, ct);
-    }
-  }
-
-  std::vector<old_tag>::const_iterator t_itr = ts.begin();
-  const std::vector<old_tag>::const_iterator t_end = ts.end();
-
-  for (size_t i = 1; i < ns.size(); ++i) {
-    if (ns[i].id > ns[i-1].id) {
-      const node &nn = ns[i-1];
-      // if the node is deleted, we don't want it in the non-history
-      // file, so skip to the next item.
-      if (!nn.visible) { continue; }
-
-      cn.push_back(nn);
-
-      while ((t_itr != t_end) && (t_itr->element_id <= nn.id)) {
-        if ((t_itr->version == nn.version) && (t_itr->element_id == nn.id)) {
-          ct.push_back(*t_itr);
-        }
-        ++t_itr;
-      }
+      std::vector<node> cn(1, m_left_over_nodes->n);
+      m_writer->nodes(cn, m_left_over_nodes->tags);
     }
   }
 
-  // push to the underlying writer
-  m_writer->nodes(cn, ct);
+  // push the current versions to the underlying writer. the tags of the
+  // other versions are skipped by the writer, as it matches them to the
+  // nodes by id and version, so the block's tags can be passed as-is.
+  std::vector<node> cn;
+  current_versions(ns, cn);
+  m_writer->nodes(cn, ts);
 
   // and save the last node for next time
   if (!ns.empty()) {
     if (!m_left_over_nodes) { m_left_over_nodes = left_over_nodes(); }
     const node &nn = ns[ns.size()-1];
     m_left_over_nodes->n = nn;
-    m_left_over_nodes->tags.clear();
+    trailing_items_of(nn, ts, m_left_over_nodes->tags);
 
-    while ((t_itr != t_end) && (t_itr->element_id <= nn.id)) {
-      if ((t_itr->version == nn.version) && (t_itr->element_id == nn.id)) {
-        m_left_over_nodes->tags.push_back(*t_itr);
-      }
-      ++t_itr;
-    }
   } else {
     m_left_over_nodes = boost::none;
   }
@@ -84,10 +114,6 @@ void history_filter<T>::nodes(const std::vector<node> &ns, const std::vector<old
 
 template <typename T>
 void history_filter<T>::ways(const std::vector<way> &ws, const std::vector<way_node> &wns, const std::vector<old_tag> &ts) {
-  std::vector<way> cw;
-  std::vector<way_node> cwn;
-  std::vector<old_tag> ct;
-
   // if there are any left over nodes, finish them now
   if (m_left_over_nodes) {
     std::vector<node> ns; std::vector<old_tag> nts;
@@ -98,66 +124,25 @@ void history_filter<T>::ways(const std::vector<way> &ws, const std::vector<way_n
   // this block - if it does, then we can ignore the left over one.
   if (m_left_over_ways && (ws.empty() || (ws[0].id > m_left_over_ways->w.id))) {
     if (m_left_over_ways->w.visible) {
-      cw.push_back(m_left_over_ways->w);
-      std::swap(m_left_over_ways->nodes, cwn);
-      std::swap(m_left_over_ways->tags, ct);
-    }
-  }
-
-  std::vector<way_node>::const_iterator n_itr = wns.begin();
-  const std::vector<way_node>::const_iterator n_end = wns.end();
-  std::vector<old_tag>::const_iterator t_itr = ts.begin();
-  const std::vector<old_tag>::const_iterator t_end = ts.end();
-
-  for (size_t i = 1; i < ws.size(); ++i) {
-    if (ws[i].id > ws[i-1].id) {
-      const way &ww = ws[i-1];
-      // if the way is deleted, we don't want it in the non-history
-      // file, so skip to the next item.
-      if (!ww.visible) { continue; }
-
-      cw.push_back(ww);
-
-      while ((n_itr != n_end) && (n_itr->way_id <= ww.id)) {
-        if ((n_itr->version == ww.version) && (n_itr->way_id == ww.id)) {
-          cwn.push_back(*n_itr);
-        }
-        ++n_itr;
-      }
-
-      while ((t_itr != t_end) && (t_itr->element_id <= ww.id)) {
-        if ((t_itr->version == ww.version) && (t_itr->element_id == ww.id)) {
-          ct.push_back(*t_itr);
-        }
-        ++t_itr;
-      }
+      std::vector<way> cw(1, m_left_over_ways->w);
+      m_writer->ways(cw, m_left_over_ways->nodes, m_left_over_ways->tags);
     }
   }
 
-  // push to the underlying writer
-  m_writer->ways(cw, cwn, ct);
+  // push the current versions to the underlying writer, passing the block's
+  // way nodes and tags as-is (see nodes() above).
+  std::vector<way> cw;
+  current_versions(ws, cw);
+  m_writer->ways(cw, wns, ts);
 
   // and save the last way for next time
   if (!ws.empty()) {
     if (!m_left_over_ways) { m_left_over_ways = left_over_ways(); }
     const way &ww = ws[ws.size()-1];
     m_left_over_ways->w = ww;
-    m_left_over_ways->nodes.clear();
-    m_left_over_ways->tags.clear();
-
-    while ((n_itr != n_end) && (n_itr->way_id <= ww.id)) {
-      if ((n_itr->version == ww.version) && (n_itr->way_id == ww.id)) {
-        m_left_over_ways->nodes.push_back(*n_itr);
-      }
-      ++n_itr;
-    }
+    trailing_items_of(ww, wns, m_left_over_ways->nodes);
+    trailing_items_of(ww, ts, m_left_over_ways->tags);
 
-    while ((t_itr != t_end) && (t_itr->element_id <= ww.id)) {
-      if ((t_itr->version == ww.version) && (t_itr->element_id == ww.id)) {
-        m_left_over_ways->tags.push_back(*t_itr);
-      }
-      ++t_itr;
-    }
   } else {
     m_left_over_ways = boost::none;
   }
@@ -165,10 +150,6 @@ void history_filter<T>::ways(const std::vector<way> &ws, const std::vector<way_n
 
 template <typename T>
 void history_filter<T>::relations(const std::vector<relation> &rs, const std::vector<relation_member> &rms, const std::vector<old_tag> &ts) {
-  std::vector<relation> cr;
-  std::vector<relation_member> crm;
-  std::vector<old_tag> ct;
-
   // if there are any ways left over, finish them now
   if (m_left_over_ways) {
     std::vector<way> ws; std::vector<way_node> wns; std::vector<old_tag> wts;
@@ -179,73 +160,52 @@ void history_filter<T>::relations(const std::vector<relation> &rs, const std::ve
   // this block - if it does, then we can ignore the left over one.
   if (m_left_over_relations && (rs.empty() || (rs[0].id > m_left_over_relations->r.id))) {
     if (m_left_over_relations->r.visible) {
-      cr.push_back(m_left_over_relations->r);
-      std::swap(m_left_over_relations->members, crm);
-      std::swap(m_left_over_relations->tags, ct);
-    }
-  }
-
-  std::vector<relation_member>::const_iterator m_itr = rms.begin();
-  const std::vector<relation_member>::const_iterator m_end = rms.end();
-  std::vector<old_tag>::const_iterator t_itr = ts.begin();
-  const std::vector<old_tag>::const_iterator t_end = ts.end();
-
-  for (size_t i = 1; i < rs.size(); ++i) {
-    if (rs[i].id > rs[i-1].id) {
-      const relation &rr = rs[i-1];
-      // if the relation is deleted, we don't want it in the non-history
-      // file, so skip to the next item.
-      if (!rr.visible) { continue; }
-
-      cr.push_back(rr);
-
-      while ((m_itr != m_end) && (m_itr->relation_id <= rr.id)) {
-        if ((m_itr->version == rr.version) && (m_itr->relation_id == rr.id)) {
-          crm.push_back(*m_itr);
-        }
-        ++m_itr;
-      }
-
-      while ((t_itr != t_end) && (t_itr->element_id <= rr.id)) {
-        if ((t_itr->version == rr.version) && (t_itr->element_id == rr.id)) {
-          ct.push_back(*t_itr);
-        }
-        ++t_itr;
-      }
+      std::vector<relation> cr(1, m_left_over_relations->r);
+      m_writer->relations(cr, m_left_over_relations->members, m_left_over_relations->tags);
     }
   }
 
-  // push to the underlying writer
-  m_writer->relations(cr, crm, ct);
+  // push the current versions to the underlying writer, passing the block's
+  // members and tags as-is (see nodes() above).
+  std::vector<relation> cr;
+  current_versions(rs, cr);
+  m_writer->relations(cr, rms, ts);
 
   // and save the last relation for next time
   if (!rs.empty()) {
     if (!m_left_over_relations) { m_left_over_relations = left_over_relations(); }
     const relation &rr = rs[rs.size()-1];
     m_left_over_relations->r = rr;
-    m_left_over_relations->members.clear();
-    m_left_over_relations->tags.clear();
+    trailing_items_of(rr, rms, m_left_over_relations->members);
+    trailing_items_of(rr, ts, m_left_over_relations->tags);
 
-    while ((m_itr != m_end) && (m_itr->relation_id <= rr.id)) {
-      if ((m_itr->version == rr.version) && (m_itr->relation_id == rr.id)) {
-        m_left_over_relations->members.push_back(*m_itr);
-      }
-      ++m_itr;
-    }
-
-    while ((t_itr != t_end) && (t_itr->element_id <= rr.id)) {
-      if ((t_itr->version == rr.version) && (t_itr->element_id == rr.id)) {
-        m_left_over_relations->tags.push_back(*t_itr);
-      }
-      ++t_itr;
-    }
   } else {
     m_left_over_relations = boost::none;
   }
 }
 
+template <typename T>
+boost::shared_ptr<output_writer> history_filter<T>::section(nwr_enum type) {
+  boost::shared_ptr<output_writer> section_writer = m_writer->section(type);
+  if (!section_writer) {
+    return section_writer;
+  }
+  return boost::shared_ptr<output_writer>(new history_filter<T>(section_writer));
+}
+
 template <typename T>
 void history_filter<T>::finish() {
+  // if there are any left over nodes or ways, which can happen when this is
+  // a section writer and no other element types follow, finish them now.
+  if (m_left_over_nodes) {
+    std::vector<node> ns; std::vector<old_tag> nts;
+    nodes(ns, nts);
+  }
+  if (m_left_over_ways) {
+    std::vector<way> ws; std::vector<way_node> wns; std::vector<old_tag> wts;
+    ways(ws, wns, wts);
+  }
+
   // if there are any left over relations, finish them now.
   if (m_left_over_relations) {
     std::vector<relation> rs; std::vector<relation_member> rms; std::vector<old_tag> rts;
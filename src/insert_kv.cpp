@@ -142,23 +142,40 @@ void from_binary(const slice_t &s, T &t) {
 } // anonymous namespace
 
 template <typename T>
-void insert_kv(T &t, const slice_t &key, const slice_t &val) {
+void insert_key(T &t, const slice_t &key) {
   static const int num_keys = T::num_keys;
   typedef typename bf::result_of::begin<T>::type it_begin;
-  typedef typename bf::result_of::end<T>::type it_end;
   typedef typename bf::result_of::advance_c<it_begin, num_keys>::type it_key;
 
   it_begin v_begin(t, 0);
   it_key v_key(t, 0);
-  it_end v_end(t, 0);
 
   bf::iterator_range<it_begin, it_key> key_range(v_begin, v_key);
-  bf::iterator_range<it_key, it_end> val_range(v_key, v_end);
 
   from_binary(key, key_range);
+}
+
+template <typename T>
+void insert_value(T &t, const slice_t &val) {
+  static const int num_keys = T::num_keys;
+  typedef typename bf::result_of::begin<T>::type it_begin;
+  typedef typename bf::result_of::end<T>::type it_end;
+  typedef typename bf::result_of::advance_c<it_begin, num_keys>::type it_key;
+
+  it_key v_key(t, 0);
+  it_end v_end(t, 0);
+
+  bf::iterator_range<it_key, it_end> val_range(v_key, v_end);
+
   from_binary(val, val_range);
 }
 
+template <typename T>
+void insert_kv(T &t, const slice_t &key, const slice_t &val) {
+  insert_key(t, key);
+  insert_value(t, val);
+}
+
 template void insert_kv<user>(user &, const slice_t &, const slice_t &);
 template void insert_kv<changeset>(changeset &, const slice_t &, const slice_t &);
 template void insert_kv<current_tag>(current_tag &, const slice_t &, const slice_t &);
@@ -169,3 +186,25 @@ template void insert_kv<way_node>(way_node &, const slice_t &, const slice_t &);
 template void insert_kv<relation>(relation &, const slice_t &, const slice_t &);
 template void insert_kv<relation_member>(relation_member &, const slice_t &, const slice_t &);
 template void insert_kv<changeset_comment>(changeset_comment &, const slice_t &, const slice_t &);
+
+template void insert_key<user>(user &, const slice_t &);
+template void insert_key<changeset>(changeset &, const slice_t &);
+template void insert_key<current_tag>(current_tag &, const slice_t &);
+template void insert_key<old_tag>(old_tag &, const slice_t &);
+template void insert_key<node>(node &, const slice_t &);
+template void insert_key<way>(way &, const slice_t &);
+template void insert_key<way_node>(way_node &, const slice_t &);
+template void insert_key<relation>(relation &, const slice_t &);
+template void insert_key<relation_member>(relation_member &, const slice_t &);
+template void insert_key<changeset_comment>(changeset_comment &, const slice_t &);
+
+template void insert_value<user>(user &, const slice_t &);
+template void insert_value<changeset>(changeset &, const slice_t &);
+template void insert_value<current_tag>(current_tag &, const slice_t &);
+template void insert_value<old_tag>(old_tag &, const slice_t &);
+template void insert_value<node>(node &, const slice_t &);
+template void insert_value<way>(way &, const slice_t &);
+template void insert_value<way_node>(way_node &, const slice_t &);
+template void insert_value<relation>(relation &, const slice_t &);
+template void insert_value<relation_member>(relation_member &, const slice_t &);
+template void insert_value<changeset_comment>(changeset_comment &, const slice_t &);
@@ -0,0 +1,115 @@
+#include "node_locations.hpp"
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cassert>
+#include <stdexcept>
+#include <boost/format.hpp>
+#include <boost/throw_exception.hpp>
+
+// number of entries initially mapped, which is doubled whenever a larger
+// node ID is inserted. the file is sparse, so this is only address space
+// and file size until it's used.
+#define INITIAL_CAPACITY (size_t(1) << 24)
+
+#define SIGN_BIT (uint32_t(1) << 31)
+
+node_locations::node_locations(const std::string &file_name)
+  : m_fd(-1), m_data(NULL), m_capacity(0), m_state(state_inserting) {
+  m_fd = open(file_name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (m_fd < 0) {
+    BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unable to create node locations file '%1%', errno = %2%.") % file_name % errno).str()));
+  }
+  // the mapping keeps the file's space until it's closed.
+  unlink(file_name.c_str());
+}
+
+node_locations::~node_locations() {
+  if (m_data != NULL) {
+    munmap(m_data, m_capacity * sizeof(entry));
+  }
+  if (m_fd >= 0) {
+    close(m_fd);
+  }
+}
+
+void node_locations::insert(int64_t id, int32_t lat, int32_t lon) {
+  assert(id > 0);
+
+  const size_t idx = size_t(id);
+  if (idx >= m_capacity) {
+    grow(idx + 1);
+  }
+
+  entry &e = m_data[idx];
+  e.lat = uint32_t(lat) ^ SIGN_BIT;
+  e.lon = uint32_t(lon) ^ SIGN_BIT;
+}
+
+bool node_locations::find(int64_t id, int32_t &lat, int32_t &lon) const {
+  if ((id < 1) || (size_t(id) >= m_capacity)) { return false; }
+
+  const entry &e = m_data[id];
+  if (e.lat == 0) { return false; }
+
+  lat = int32_t(e.lat ^ SIGN_BIT);
+  lon = int32_t(e.lon ^ SIGN_BIT);
+  return true;
+}
+
+void node_locations::complete() {
+  boost::lock_guard<boost::mutex> lock(m_mutex);
+  if (m_state == state_inserting) {
+    m_state = state_complete;
+    m_cond.notify_all();
+  }
+}
+
+void node_locations::abandon() {
+  boost::lock_guard<boost::mutex> lock(m_mutex);
+  if (m_state == state_inserting) {
+    m_state = state_abandoned;
+    m_cond.notify_all();
+  }
+}
+
+void node_locations::wait() const {
+  boost::unique_lock<boost::mutex> lock(m_mutex);
+  while (m_state == state_inserting) {
+    m_cond.wait(lock);
+  }
+  if (m_state == state_abandoned) {
+    BOOST_THROW_EXCEPTION(std::runtime_error("Node locations are not available, as writing the nodes failed."));
+  }
+}
+
+void node_locations::grow(size_t min_capacity) {
+  size_t capacity = (m_capacity > 0) ? m_capacity : INITIAL_CAPACITY;
+  while (capacity < min_capacity) {
+    capacity *= 2;
+  }
+
+  const size_t old_bytes = m_capacity * sizeof(entry);
+  const size_t new_bytes = capacity * sizeof(entry);
+
+  if (ftruncate(m_fd, off_t(new_bytes)) != 0) {
+    BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unable to extend node locations file to %1% bytes, errno = %2%.") % new_bytes % errno).str()));
+  }
+
+  void *ptr = MAP_FAILED;
+  if (m_data == NULL) {
+    ptr = mmap(NULL, new_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+
+  } else {
+    ptr = mremap(m_data, old_bytes, new_bytes, MREMAP_MAYMOVE);
+  }
+
+  if (ptr == MAP_FAILED) {
+    BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unable to map %1% bytes for the node locations, errno = %2%.") % new_bytes % errno).str()));
+  }
+
+  m_data = static_cast<entry *>(ptr);
+  m_capacity = capacity;
+}
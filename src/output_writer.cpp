@@ -1,6 +1,43 @@
 #include "output_writer.hpp"
 
+#include <fstream>
+#include <stdexcept>
+#include <boost/format.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/exception/all.hpp>
+
+namespace fs = boost::filesystem;
+
 output_writer::~output_writer() {
 }
 
+bool output_writer::wants(nwr_enum) const {
+  return true;
+}
+
+std::string section_file_name(const std::string &file_name, nwr_enum section) {
+  const char *name =
+    (section == nwr_node) ? "nodes" :
+    (section == nwr_way) ? "ways" :
+    "relations";
 
+  return (boost::format("%1%.part-%2%") % file_name % name).str();
+}
+
+void append_section_file(std::ostream &out, const std::string &section_file) {
+  {
+    std::ifstream in(section_file.c_str(), std::ios::binary);
+    if (!in.is_open()) {
+      BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unable to open section file '%1%'.") % section_file).str()));
+    }
+    // an empty section file is fine, but operator<< would set failbit on
+    // the output if nothing was copied.
+    if (in.peek() != std::ifstream::traits_type::eof()) {
+      out << in.rdbuf();
+    }
+    if (!out.good()) {
+      BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unable to append section file '%1%' to output.") % section_file).str()));
+    }
+  }
+  fs::remove(section_file);
+}
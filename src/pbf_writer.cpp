@@ -1,81 +1,339 @@
 #include "pbf_writer.hpp"
 #include "config.h"
 #include "writer_common.hpp"
+#include "node_locations.hpp"
 
-#include <google/protobuf/io/gzip_stream.h>
-#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
 #include <osmpbf/osmpbf.h>
 
 #include <boost/unordered_map.hpp>
 #include <boost/foreach.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/exception_ptr.hpp>
+#include <boost/format.hpp>
+#include <boost/function.hpp>
+#include <boost/bind.hpp>
 
 #include <zlib.h>
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+#ifdef WITH_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
 #include <arpa/inet.h>
 #include <fstream>
-
-#define ASSERT_EQ(a, b) { if ((a) != (b)) {                 \
-      std::ostringstream out;                               \
-      out << "Assertion " #a " == " #b " failed, ";         \
-      out << (a) << " != " << (b) << ".";                   \
-      BOOST_THROW_EXCEPTION(std::runtime_error(out.str())); \
-    } }
-#define ASSERT_NOT_NULL(a) { if ((a) == NULL) {             \
-      std::ostringstream out;                               \
-      out << "Assertion " #a " != NULL failed, ";           \
-      out << (a) << " is NULL.";                            \
-      BOOST_THROW_EXCEPTION(std::runtime_error(out.str())); \
-    } }
+#include <deque>
+#include <algorithm>
+#include <cstring>
+#include <limits>
 
 namespace bt = boost::posix_time;
 
 namespace {
 
+/**
+ * buffer of data in the protobuf wire format. blocks are encoded straight
+ * into these, rather than built up as the generated OSMPBF message objects
+ * and then serialised, which allocates for every element and needs another
+ * pass over the whole block to work out its size.
+ *
+ * all the OSMPBF field numbers used here are below 16, so that each key is
+ * a single byte.
+ */
+struct wire_buffer {
+  enum wire_type {
+    wire_varint = 0,
+    wire_length = 2
+  };
+
+  void varint(uint64_t v) {
+    char buf[10];
+    size_t n = 0;
+    while (v >= 0x80) {
+      buf[n++] = char(v | 0x80);
+      v >>= 7;
+    }
+    buf[n++] = char(v);
+    m_data.append(buf, n);
+  }
+
+  // zig-zag encoded, for the sint32 and sint64 types.
+  void svarint(int64_t v) {
+    varint((uint64_t(v) << 1) ^ uint64_t(v >> 63));
+  }
+
+  void key(int field, wire_type type) {
+    m_data.push_back(char((field << 3) | type));
+  }
+
+  void bytes(int field, const char *data, size_t len) {
+    key(field, wire_length);
+    varint(len);
+    m_data.append(data, len);
+  }
+
+  // a sub-message, or other length-delimited field, from another buffer.
+  void field(int field, const wire_buffer &b) {
+    bytes(field, b.m_data.data(), b.m_data.size());
+  }
+
+  // a packed repeated field, which isn't written at all if it's empty.
+  void packed(int field, const wire_buffer &b) {
+    if (!b.empty()) { this->field(field, b); }
+  }
+
+  void append(const wire_buffer &b) { m_data.append(b.m_data); }
+  void append(const char *data, size_t len) { m_data.append(data, len); }
+
+  const char *data() const { return m_data.data(); }
+  size_t size() const { return m_data.size(); }
+  bool empty() const { return m_data.empty(); }
+  void clear() { m_data.clear(); }
+  std::string &str() { return m_data; }
+
+private:
+  std::string m_data;
+};
+
+inline size_t varint_size(uint64_t v) {
+  size_t n = 1;
+  while (v >= 0x80) {
+    v >>= 7;
+    ++n;
+  }
+  return n;
+}
+
+// encoded size of a length-delimited field with len bytes of content.
+inline size_t field_size(size_t len) {
+  return 1 + varint_size(len) + len;
+}
+
+// encoded size of a packed field, which isn't written at all if it's empty.
+inline size_t packed_size(size_t len) {
+  return (len == 0) ? 0 : field_size(len);
+}
+
+/**
+ * counts the bytes which would be written to a wire_buffer, without writing
+ * them, so that the exact size of a block can be worked out without
+ * encoding it.
+ */
+struct wire_counter {
+  wire_counter() : m_size(0) {}
+
+  void varint(uint64_t v) { m_size += varint_size(v); }
+  void svarint(int64_t v) { varint((uint64_t(v) << 1) ^ uint64_t(v >> 63)); }
+  void key(int, wire_buffer::wire_type) { ++m_size; }
+  void bytes(int, const char *, size_t len) { m_size += field_size(len); }
+  void field(int, const wire_counter &b) { m_size += field_size(b.m_size); }
+  void packed(int f, const wire_counter &b) {
+    if (!b.empty()) { field(f, b); }
+  }
+
+  size_t size() const { return m_size; }
+  bool empty() const { return m_size == 0; }
+  void clear() { m_size = 0; }
+
+private:
+  size_t m_size;
+};
+
+/**
+ * the variants of a block which can be written from the same encoding:
+ * with the user info of its elements, and without. an output and its
+ * no-userinfo counterpart are encoded together, as they only differ in
+ * the user info.
+ */
+enum block_variant {
+  variant_with_users = 1,
+  variant_without_users = 2,
+  all_variants = 3
+};
+
+// the index of a single variant, for arrays of things for each variant.
+inline size_t variant_index(block_variant v) {
+  return (v == variant_with_users) ? 0 : 1;
+}
+
+/**
+ * the strings of a block. each string is copied once, into an arena, and
+ * found again through an open-addressed hash table of IDs into the arena,
+ * so that interning a tag doesn't allocate. the uses of each string are
+ * counted, so that the IDs can be renumbered before the block is written,
+ * giving the lowest (and shortest to encode) IDs to the most used strings.
+ *
+ * the uses are counted separately for each variant of the block, as user
+ * names are only used in one of them, so each has its own string table
+ * with just the strings used in it, in the order that it would have seen
+ * them on its own.
+ */
 struct string_table {
-  typedef boost::unordered_map<std::string, int> string_map_t;
-
-  string_table() : m_strings(), m_indexed_strings(), m_next_id(1), m_approx_size(0) {}
-
-  int operator()(const std::string &s) {
-    string_map_t::iterator itr = m_strings.find(s);
-    if (itr == m_strings.end()) {
-      int key = m_next_id;
-      ++m_next_id;
-      m_strings.insert(std::make_pair(s, key));
-      m_indexed_strings.push_back(s);
-      // keep track of approximate size - strings are stored as the bytes of
-      // the string, length prefixed with varint which should be 1 byte if
-      // the value is < 128, and more if it's more. OSM strings are generally
-      // limited to 255 unicode chars, so unlikely to be > 16k bytes.
-      m_approx_size += s.size() + (s.size() > 128 ? 2 : 1);
-      return key;
+  typedef boost::unordered_map<const user_info *, uint32_t> user_map_t;
 
+  explicit string_table(unsigned int variants)
+    : m_variants(variants), m_arena(), m_offsets(1, 0), m_slots(1024), m_users() {
+  }
+
+  // the string ID of a string used in the given variants of the block.
+  uint32_t operator()(const std::string &s, unsigned int variants = all_variants) {
+    const uint32_t id = intern(s.data(), s.size());
+    use(id, variants);
+    return id;
+  }
+
+  // the string ID of a user's display name. users are remembered by their
+  // entry in the user index, so the name is only hashed the first time
+  // each user is seen in a block.
+  uint32_t operator()(const user_info *u) {
+    uint32_t id = 0;
+    user_map_t::iterator itr = m_users.find(u);
+    if (itr == m_users.end()) {
+      id = intern(u->display_name, u->display_name_length);
+      m_users.insert(std::make_pair(u, id));
     } else {
-      return itr->second;
+      id = itr->second;
     }
+    use(id, variant_with_users);
+    return id;
   }
 
-  size_t approx_size() const { return m_approx_size; }
+  // sort the strings used in a variant by how often they've been used,
+  // most used first, and fill remap with the new ID of each string,
+  // indexed by its current ID. strings used equally often stay in the
+  // order they were first seen.
+  void renumber(block_variant v, std::vector<uint32_t> &remap) {
+    usage &u = m_usage[variant_index(v)];
+    std::stable_sort(u.order.begin(), u.order.end(), more_used(u.counts));
+    remap.assign(m_offsets.size(), 0);
+    for (size_t i = 0; i < u.order.size(); ++i) {
+      remap[u.order[i]] = uint32_t(i + 1);
+    }
+  }
 
-  void clear() {
-    m_strings.clear();
-    m_indexed_strings.clear();
-    m_next_id = 1;
-    m_approx_size = 0;
+  // the size of the StringTable message of a variant, as it would be
+  // written now. this doesn't depend on the order of the strings.
+  size_t byte_size(block_variant v) const {
+    return m_usage[variant_index(v)].byte_size;
   }
 
-  void write(OSMPBF::StringTable *st) const {
+  // write the strings used in a variant as the block's stringtable field.
+  void write(block_variant v, wire_buffer &block) const {
+    const usage &u = m_usage[variant_index(v)];
+    block.key(1, wire_buffer::wire_length);
+    block.varint(u.byte_size);
+
     // id 0 string is reserved for dense nodes, so just put an empty one in here.
-    st->add_s("");
-    for (std::vector<std::string>::const_iterator itr = m_indexed_strings.begin();
-         itr != m_indexed_strings.end(); ++itr) {
-      st->add_s(*itr);
+    block.bytes(1, "", 0);
+    BOOST_FOREACH(uint32_t id, u.order) {
+      block.bytes(1, m_arena.data() + m_offsets[id - 1], length(id));
+    }
+  }
+
+private:
+  // a string ID and its hash, or an empty slot if the ID is zero, which
+  // is never interned.
+  struct slot {
+    slot() : id(0), hash(0) {}
+    uint32_t id, hash;
+  };
+
+  // the strings used in one variant of the block.
+  struct usage {
+    usage() : counts(1, 0), order(), byte_size(field_size(0)) {}
+
+    // the number of times each string has been used, by ID.
+    std::vector<uint32_t> counts;
+    // the IDs, in the order they're written in the string table.
+    std::vector<uint32_t> order;
+    // the size of the StringTable message, including the empty string at
+    // id 0.
+    size_t byte_size;
+  };
+
+  struct more_used {
+    explicit more_used(const std::vector<uint32_t> &counts) : m_counts(counts) {}
+    bool operator()(uint32_t a, uint32_t b) const { return m_counts[a] > m_counts[b]; }
+    const std::vector<uint32_t> &m_counts;
+  };
+
+  // FNV-1a, which is quick for the short strings that most tags are.
+  static uint32_t hash(const char *s, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; ++i) {
+      h = (h ^ uint8_t(s[i])) * 16777619u;
+    }
+    return h;
+  }
+
+  size_t length(uint32_t id) const { return m_offsets[id] - m_offsets[id - 1]; }
+
+  void use(uint32_t id, unsigned int variants) {
+    for (size_t i = 0; i < 2; ++i) {
+      if ((variants & m_variants & (1u << i)) == 0) { continue; }
+      usage &u = m_usage[i];
+      if (u.counts[id]++ == 0) {
+        u.order.push_back(id);
+        u.byte_size += field_size(length(id));
+      }
     }
   }
 
-  string_map_t m_strings;
-  std::vector<std::string> m_indexed_strings;
-  int m_next_id;
-  size_t m_approx_size;
+  uint32_t intern(const char *s, size_t len) {
+    const uint32_t h = hash(s, len);
+    const size_t mask = m_slots.size() - 1;
+    size_t i = h & mask;
+    while (m_slots[i].id != 0) {
+      const slot &sl = m_slots[i];
+      if ((sl.hash == h) && (length(sl.id) == len) &&
+          (std::memcmp(m_arena.data() + m_offsets[sl.id - 1], s, len) == 0)) {
+        return sl.id;
+      }
+      i = (i + 1) & mask;
+    }
+
+    const uint32_t id = uint32_t(m_offsets.size());
+    m_arena.append(s, len);
+    m_offsets.push_back(m_arena.size());
+    m_usage[0].counts.push_back(0);
+    m_usage[1].counts.push_back(0);
+    m_slots[i].id = id;
+    m_slots[i].hash = h;
+
+    // keep the table at most half full, so that probes stay short.
+    if (2 * id > m_slots.size()) {
+      grow();
+    }
+    return id;
+  }
+
+  void grow() {
+    std::vector<slot> slots(2 * m_slots.size());
+    const size_t mask = slots.size() - 1;
+    BOOST_FOREACH(const slot &sl, m_slots) {
+      if (sl.id == 0) { continue; }
+      size_t i = sl.hash & mask;
+      while (slots[i].id != 0) {
+        i = (i + 1) & mask;
+      }
+      slots[i] = sl;
+    }
+    m_slots.swap(slots);
+  }
+
+  const unsigned int m_variants;
+  // the strings, end to end, with string ID i from m_offsets[i-1] up to
+  // m_offsets[i]. ID 0 is the reserved empty string, which ends at 0.
+  std::string m_arena;
+  std::vector<size_t> m_offsets;
+  // the hash table, which always has a power of two size.
+  std::vector<slot> m_slots;
+  user_map_t m_users;
+  usage m_usage[2];
 };
 
 // simple function to calculate the delta between the last value of
@@ -88,55 +346,254 @@ inline T delta(T &last, T cur) {
   return d;
 }
 
-} // anonymous namespace
+/**
+ * the metadata of a node, way or relation, as it goes in the Info message,
+ * or the columns of the DenseInfo for dense nodes.
+ */
+struct element_info {
+  int32_t version;
+  int64_t timestamp;
+  int64_t changeset;
+  bool has_visible, visible;
+  bool has_user;
+  int32_t uid;
+  int32_t user_sid;
+};
 
-struct pbf_writer::pimpl {
-  enum element_type {
-    element_NULL,
-    element_CHANGESET,
-    element_NODE,
-    element_WAY,
-    element_RELATION
+/**
+ * encodes the elements of a PrimitiveGroup in the wire format as they're
+ * added. each node, way or relation is kept in columns for its fields until
+ * the next one is added, as the tags, way nodes and members come after the
+ * element but have to be written in field order. dense nodes are kept in
+ * columns for the whole group, deltas and all, and only put together when
+ * the group is written.
+ *
+ * with a wire_counter as the buffer, nothing is encoded, but the exact
+ * size of the group is still kept track of.
+ */
+template <typename Buffer>
+struct basic_group_encoder {
+  enum element_kind {
+    kind_none,
+    kind_node,
+    kind_way,
+    kind_relation
   };
 
-  pimpl(const std::string &out_name, const bt::ptime &now, user_info_level uil, historical_versions hv,
-        const user_map_t &user_map, const boost::program_options::variables_map &options) 
-    : num_elements(0), buffer(), out(out_name.c_str()), str_table(),
-      pblock(), pgroup(pblock.add_primitivegroup()), 
-      current_node(NULL), current_way(NULL), current_relation(NULL),
-      m_byte_limit(int(0.125 * OSMPBF::max_uncompressed_blob_size)),
-      m_current_element(element_NULL),
-      m_last_way_node_ref(0),
-      m_last_relation_member_ref(0),
-      m_est_pblock_size(0),
-      m_historical_versions(hv),
-      m_user_info_level(uil),
-      m_user_map(user_map),
-      m_dense_nodes(options["dense-nodes"].as<bool>()),
-      m_dense_section(NULL), 
-      m_changeset_user_map(),
-      m_recheck_elements(int(element_RELATION) + 1),
-      m_generator_name(options["generator"].as<std::string>()),
-      m_source_name(options["meta-source"].as<std::string>()) {
-    // different re-check limits per type so that we can better
-    // adapt to the different sizes of elements, and hit the
-    // byte limit without overflowing it.
-    m_recheck_elements[element_NULL] = 1;
-    m_recheck_elements[element_CHANGESET] = 1;
-    m_recheck_elements[element_NODE] = 16000;
-    m_recheck_elements[element_WAY] = 8000;
-    m_recheck_elements[element_RELATION] = 200;
-
-    reset_dense_ids();
-    m_est_pgroup_sz = 0;
+  basic_group_encoder() : m_kind(kind_none), m_dense(false) {
+    reset_deltas();
+  }
 
-    write_header_block(now);
+  void add_node(int64_t id, int32_t lat, int32_t lon, const element_info &info) {
+    begin_element(kind_node, info);
+    m_element.key(1, wire_buffer::wire_varint);
+    m_element.svarint(id);
+    m_lat = lat;
+    m_lon = lon;
   }
 
-  ~pimpl() {
+  void add_way(int64_t id, const element_info &info) {
+    begin_element(kind_way, info);
+    m_element.key(1, wire_buffer::wire_varint);
+    m_element.varint(uint64_t(id));
+    m_last_ref = 0;
+    m_last_lat = 0;
+    m_last_lon = 0;
+  }
+
+  void add_relation(int64_t id, const element_info &info) {
+    begin_element(kind_relation, info);
+    m_element.key(1, wire_buffer::wire_varint);
+    m_element.varint(uint64_t(id));
+    m_last_ref = 0;
+  }
+
+  void add_tag(int key, int val) {
+    m_keys.varint(uint32_t(key));
+    m_vals.varint(uint32_t(val));
+  }
+
+  void add_way_node(int64_t ref) {
+    m_refs.svarint(delta<int64_t>(m_last_ref, ref));
+  }
+
+  // a way node with its location, for the LocationsOnWays feature.
+  void add_way_node(int64_t ref, int32_t lat, int32_t lon) {
+    m_refs.svarint(delta<int64_t>(m_last_ref, ref));
+    m_lats.svarint(delta<int64_t>(m_last_lat, lat));
+    m_lons.svarint(delta<int64_t>(m_last_lon, lon));
+  }
+
+  void add_member(int role, int64_t ref, int type) {
+    m_roles.varint(uint64_t(int64_t(role)));
+    m_refs.svarint(delta<int64_t>(m_last_ref, ref));
+    m_types.varint(uint64_t(int64_t(type)));
+  }
+
+  // dense nodes always have uid and user_sid, which are zero and the empty
+  // string for nodes without a user.
+  void add_dense_node(int64_t id, int32_t lat, int32_t lon, const element_info &info) {
+    finish_element();
+    m_dense = true;
+    m_dense_ids.svarint(delta<int64_t>(m_last_dense_id, id));
+    m_dense_lons.svarint(delta<int64_t>(m_last_dense_lon, lon));
+    m_dense_lats.svarint(delta<int64_t>(m_last_dense_lat, lat));
+    m_dense_versions.varint(uint64_t(int64_t(info.version)));
+    m_dense_timestamps.svarint(delta<int64_t>(m_last_dense_timestamp, info.timestamp));
+    m_dense_changesets.svarint(delta<int64_t>(m_last_dense_changeset, info.changeset));
+    if (info.has_visible) {
+      m_dense_visibles.varint(info.visible ? 1 : 0);
+    }
+    m_dense_uids.svarint(delta<int32_t>(m_last_dense_uid, info.uid));
+    m_dense_user_sids.svarint(delta<int32_t>(m_last_dense_user_sid, info.user_sid));
+  }
+
+  void add_dense_tag(int key, int val) {
+    m_dense_keys_vals.varint(uint64_t(int64_t(key)));
+    m_dense_keys_vals.varint(uint64_t(int64_t(val)));
+  }
+
+  void finish_dense_node() {
+    m_dense_keys_vals.varint(0);
   }
 
-  void reset_dense_ids() {
+  // the size of the PrimitiveGroup message, as it would be written now.
+  // this finishes the current element, so can only be called between
+  // elements.
+  size_t byte_size() {
+    finish_element();
+    size_t size = m_group.size();
+    if (m_dense) {
+      size += field_size(dense_size());
+    }
+    return size;
+  }
+
+  // write the group to the block as a primitivegroup field, and start a
+  // new, empty group.
+  void write(Buffer &block) {
+    finish_element();
+    if (m_dense) {
+      write_dense();
+    }
+    block.field(2, m_group);
+
+    m_group.clear();
+    m_dense = false;
+    reset_deltas();
+  }
+
+private:
+  void begin_element(element_kind kind, const element_info &info) {
+    finish_element();
+    m_kind = kind;
+
+    m_info.key(1, wire_buffer::wire_varint);
+    m_info.varint(uint64_t(int64_t(info.version)));
+    m_info.key(2, wire_buffer::wire_varint);
+    m_info.varint(uint64_t(info.timestamp));
+    m_info.key(3, wire_buffer::wire_varint);
+    m_info.varint(uint64_t(info.changeset));
+    if (info.has_user) {
+      m_info.key(4, wire_buffer::wire_varint);
+      m_info.varint(uint64_t(int64_t(info.uid)));
+      m_info.key(5, wire_buffer::wire_varint);
+      m_info.varint(uint32_t(info.user_sid));
+    }
+    if (info.has_visible) {
+      m_info.key(6, wire_buffer::wire_varint);
+      m_info.varint(info.visible ? 1 : 0);
+    }
+  }
+
+  // put together the fields of the current element, if there is one, and
+  // add it to the group.
+  void finish_element() {
+    if (m_kind == kind_none) { return; }
+
+    m_element.packed(2, m_keys);
+    m_element.packed(3, m_vals);
+    m_element.field(4, m_info);
+
+    if (m_kind == kind_node) {
+      m_element.key(8, wire_buffer::wire_varint);
+      m_element.svarint(m_lat);
+      m_element.key(9, wire_buffer::wire_varint);
+      m_element.svarint(m_lon);
+      m_group.field(1, m_element);
+
+    } else if (m_kind == kind_way) {
+      m_element.packed(8, m_refs);
+      m_element.packed(9, m_lats);
+      m_element.packed(10, m_lons);
+      m_group.field(3, m_element);
+
+    } else {
+      m_element.packed(8, m_roles);
+      m_element.packed(9, m_refs);
+      m_element.packed(10, m_types);
+      m_group.field(4, m_element);
+    }
+
+    m_kind = kind_none;
+    m_element.clear();
+    m_info.clear();
+    m_keys.clear();
+    m_vals.clear();
+    m_refs.clear();
+    m_lats.clear();
+    m_lons.clear();
+    m_roles.clear();
+    m_types.clear();
+  }
+
+  size_t dense_info_size() const {
+    return packed_size(m_dense_versions.size()) +
+      packed_size(m_dense_timestamps.size()) +
+      packed_size(m_dense_changesets.size()) +
+      packed_size(m_dense_uids.size()) +
+      packed_size(m_dense_user_sids.size()) +
+      packed_size(m_dense_visibles.size());
+  }
+
+  size_t dense_size() const {
+    return packed_size(m_dense_ids.size()) +
+      field_size(dense_info_size()) +
+      packed_size(m_dense_lats.size()) +
+      packed_size(m_dense_lons.size()) +
+      packed_size(m_dense_keys_vals.size());
+  }
+
+  void write_dense() {
+    m_group.key(2, wire_buffer::wire_length);
+    m_group.varint(dense_size());
+
+    m_group.packed(1, m_dense_ids);
+    m_group.key(5, wire_buffer::wire_length);
+    m_group.varint(dense_info_size());
+    m_group.packed(1, m_dense_versions);
+    m_group.packed(2, m_dense_timestamps);
+    m_group.packed(3, m_dense_changesets);
+    m_group.packed(4, m_dense_uids);
+    m_group.packed(5, m_dense_user_sids);
+    m_group.packed(6, m_dense_visibles);
+    m_group.packed(8, m_dense_lats);
+    m_group.packed(9, m_dense_lons);
+    m_group.packed(10, m_dense_keys_vals);
+
+    m_dense_ids.clear();
+    m_dense_versions.clear();
+    m_dense_timestamps.clear();
+    m_dense_changesets.clear();
+    m_dense_uids.clear();
+    m_dense_user_sids.clear();
+    m_dense_visibles.clear();
+    m_dense_lats.clear();
+    m_dense_lons.clear();
+    m_dense_keys_vals.clear();
+  }
+
+  void reset_deltas() {
     m_last_dense_id = 0;
     m_last_dense_lat = 0;
     m_last_dense_lon = 0;
@@ -146,518 +603,1339 @@ struct pbf_writer::pimpl {
     m_last_dense_user_sid = 0;
   }
 
-  void write_header_block(const bt::ptime &now) {
-    using namespace OSMPBF;
+  // the elements which have been finished.
+  Buffer m_group;
 
-    HeaderBlock header;
-    HeaderBBox *bbox = header.mutable_bbox();
-    bbox->set_left  (-180L * lonlat_resolution);
-    bbox->set_right ( 180L * lonlat_resolution);
-    bbox->set_top   (  90L * lonlat_resolution);
-    bbox->set_bottom( -90L * lonlat_resolution);
+  // the current node, way or relation.
+  element_kind m_kind;
+  Buffer m_element, m_info, m_keys, m_vals, m_refs, m_lats, m_lons, m_roles, m_types;
+  int32_t m_lat, m_lon;
+  int64_t m_last_ref, m_last_lat, m_last_lon;
 
-    header.add_required_features("OsmSchema-V" OSM_VERSION_TEXT);
-    if (m_historical_versions == historical_versions::FULL) { 
-      header.add_required_features("HistoricalInformation");
-    }
-    if (m_dense_nodes) {
-      header.add_required_features("DenseNodes");
+  // the dense nodes, if there are any.
+  bool m_dense;
+  Buffer m_dense_ids, m_dense_lats, m_dense_lons, m_dense_keys_vals;
+  Buffer m_dense_versions, m_dense_timestamps, m_dense_changesets;
+  Buffer m_dense_uids, m_dense_user_sids, m_dense_visibles;
+  int64_t m_last_dense_id;
+  int64_t m_last_dense_lat;
+  int64_t m_last_dense_lon;
+  int64_t m_last_dense_timestamp;
+  int64_t m_last_dense_changeset;
+  int32_t m_last_dense_uid;
+  int32_t m_last_dense_user_sid;
+};
+
+/**
+ * reads back the wire format written by wire_buffer, one field at a time.
+ */
+struct wire_reader {
+  wire_reader(const char *begin, const char *end)
+    : m_ptr(begin), m_end(end), m_field_begin(begin), m_field(0), m_type(0) {}
+
+  // move on to the next field, returning false if there are no more.
+  bool next() {
+    if (m_ptr == m_end) { return false; }
+    m_field_begin = m_ptr;
+    const uint64_t k = varint();
+    m_field = int(k >> 3);
+    m_type = int(k & 7);
+    return true;
+  }
+
+  int field() const { return m_field; }
+  bool at_end() const { return m_ptr == m_end; }
+
+  uint64_t varint() {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      if (m_ptr == m_end) { break; }
+      const uint8_t b = uint8_t(*m_ptr++);
+      v |= uint64_t(b & 0x7f) << shift;
+      if ((b & 0x80) == 0) { return v; }
     }
-    header.add_optional_features("Has_Metadata");
-    header.add_optional_features("Sort.Type_then_ID");
-    header.set_writingprogram(m_generator_name);
-    header.set_source(m_source_name);
-#ifndef WITH_OLD_OSMPBF
-    header.set_osmosis_replication_timestamp((now - bt::from_time_t(time_t(0))).total_seconds());
-#endif
+    BOOST_THROW_EXCEPTION(std::runtime_error("Truncated varint while re-reading PBF block."));
+  }
 
-    write_blob(header, "OSMHeader");
+  int64_t svarint() {
+    const uint64_t v = varint();
+    return int64_t(v >> 1) ^ -int64_t(v & 1);
   }
 
-  void write_blob(const google::protobuf::MessageLite &message, const std::string &type) {
-    using namespace OSMPBF;
-    using google::protobuf::io::StringOutputStream;
-    using google::protobuf::io::GzipOutputStream;
+  // the contents of the current field, which must be length-delimited.
+  wire_reader contents() {
+    const uint64_t len = varint();
+    if (len > uint64_t(m_end - m_ptr)) {
+      BOOST_THROW_EXCEPTION(std::runtime_error("Truncated field while re-reading PBF block."));
+    }
+    wire_reader r(m_ptr, m_ptr + len);
+    m_ptr += len;
+    return r;
+  }
 
-    Blob blob;
-    size_t uncompressed_size = message.ByteSizeLong();
-    // sanity check - if we're about to violate the OSMPBF format rules
-    // then we'd rather stop than ship an invalid file.
-    if (uncompressed_size >= OSMPBF::max_uncompressed_blob_size) {
-      std::ostringstream ostr;
-      ostr << "Unable to write block of type " << type << ", uncompressed size " << uncompressed_size
-           << " because it is larger than the maximum allowed " << OSMPBF::max_uncompressed_blob_size
-           << "." << std::endl;
-      BOOST_THROW_EXCEPTION(std::runtime_error(ostr.str()));
+  // copy the whole of the current field, key and all, without decoding it.
+  void copy(wire_buffer &out) {
+    if (m_type == wire_buffer::wire_varint) {
+      varint();
+    } else if (m_type == wire_buffer::wire_length) {
+      contents();
+    } else {
+      BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unexpected wire type %1% while re-reading PBF block.") % m_type).str()));
     }
-    blob.set_raw_size(uncompressed_size);
+    out.append(m_field_begin, m_ptr - m_field_begin);
+  }
 
-    std::string str;
-    StringOutputStream string_stream(&str);
-    GzipOutputStream::Options options;
-    options.format = GzipOutputStream::ZLIB;
-    options.compression_level = 9;
-    GzipOutputStream gzip_stream(&string_stream, options);
-    message.SerializeToZeroCopyStream(&gzip_stream);
-    gzip_stream.Close();
-    blob.set_zlib_data(str);
-    str.clear();
+private:
+  const char *m_ptr, *m_end, *m_field_begin;
+  int m_field, m_type;
+};
 
-    BlobHeader blob_header;
-    blob_header.set_type(type);
-    blob_header.set_datasize(blob.ByteSizeLong());
+/**
+ * rewrites the primitivegroups of a block with their string IDs changed,
+ * once the string table has been renumbered. only the fields which are, or
+ * contain, string IDs are decoded; everything else is copied as it is.
+ *
+ * the user info can also be stripped out, to write the variant of a block
+ * without it from the same encoding. this leaves the block exactly as it
+ * would have been encoded without user info in the first place.
+ */
+struct string_renumberer {
+  string_renumberer() : m_remap(NULL), m_strip_users(false), m_empty_sid(0) {}
+
+  // rewrite the groups in `groups`, which are primitiveblock fields, on the
+  // end of the block. if stripping the user info, dense nodes' user_sids
+  // are all set to empty_sid, the (old) ID of the empty string.
+  void operator()(const std::vector<uint32_t> &remap, const wire_buffer &groups, wire_buffer &block,
+                  bool strip_users = false, uint32_t empty_sid = 0) {
+    m_remap = &remap;
+    m_strip_users = strip_users;
+    m_empty_sid = empty_sid;
+    wire_reader in(groups.data(), groups.data() + groups.size());
+    while (in.next()) {
+      if (in.field() == 2) {
+        group(in.contents());
+        block.field(2, m_group);
+      } else {
+        in.copy(block);
+      }
+    }
+  }
 
-    int blob_header_size = blob_header.ByteSizeLong();
-    if (blob_header_size < 0) {
-      std::ostringstream ostr;
-      ostr << "Unable to write blob header size " << blob_header_size 
-           << " because it will not correctly cast to uint32_t.";
-      BOOST_THROW_EXCEPTION(std::runtime_error(ostr.str()));
+private:
+  uint32_t id(uint64_t old_id) const {
+    if (old_id >= m_remap->size()) {
+      BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("String ID %1% is outside the block's string table.") % old_id).str()));
     }
-    uint32_t bh_size = htonl(uint32_t(blob_header_size));
-    out.write((char *)&bh_size, sizeof bh_size);
-    out << blob_header.SerializeAsString();
-    out << blob.SerializeAsString();
-    out.flush();
+    return (*m_remap)[old_id];
   }
 
-  void check_overflow(element_type type) {
-    if ((m_current_element == element_NULL) ||
-        (m_current_element == element_CHANGESET)) {  // <- to deal with OSMPBF brokenness...
-      m_current_element = type;
+  void group(wire_reader in) {
+    m_group.clear();
+    while (in.next()) {
+      const int f = in.field();
+      if ((f == 1) || (f == 3) || (f == 4)) {
+        // nodes, ways and relations all have keys, values and info in
+        // the same fields, and only relations have more string IDs.
+        element(in.contents(), f == 4);
+        m_group.field(f, m_element);
+      } else if (f == 2) {
+        dense(in.contents());
+        m_group.field(f, m_dense);
+      } else {
+        in.copy(m_group);
+      }
     }
+  }
 
-    if ((m_current_element != type) ||
-        (num_elements >= m_recheck_elements[m_current_element]) ||
-        (m_current_element == element_RELATION && (m_est_pblock_size + m_est_pgroup_sz + str_table.approx_size()) > m_byte_limit)) {
-      m_est_pblock_size += pgroup->ByteSizeLong();
-      const size_t str_table_size = str_table.approx_size();
-      if ((size_t(m_est_pblock_size) + str_table_size) > size_t(std::numeric_limits<int>::max())) {
-        BOOST_THROW_EXCEPTION(std::runtime_error("Pblock + string table got too big."));
+  void element(wire_reader in, bool is_relation) {
+    m_element.clear();
+    while (in.next()) {
+      const int f = in.field();
+      if ((f == 2) || (f == 3) || (is_relation && (f == 8))) {
+        packed(in.contents(), f, m_element);
+      } else if (f == 4) {
+        info(in.contents());
+        m_element.field(f, m_info);
+      } else {
+        in.copy(m_element);
       }
-      bool new_block = ((m_current_element != type) ||
-                        ((m_est_pblock_size + int(str_table_size)) >= m_byte_limit));
+    }
+  }
 
-      if (new_block) {
-        str_table.write(pblock.mutable_stringtable());
+  void info(wire_reader in) {
+    m_info.clear();
+    while (in.next()) {
+      if (m_strip_users && ((in.field() == 4) || (in.field() == 5))) {
+        in.varint();
+      } else if (in.field() == 5) {
+        m_info.key(5, wire_buffer::wire_varint);
+        m_info.varint(id(in.varint()));
+      } else {
+        in.copy(m_info);
+      }
+    }
+  }
 
-        // before writing, check that, if we have dense nodes, we have the
-        // same number of entries for all the arrays.
-        if (m_dense_nodes && (m_dense_section != NULL)) {
-          check_dense_node_arrays();
-        }
+  // keys and values, roles, and the dense nodes' keys_vals, which uses the
+  // reserved empty string (ID 0, which stays as it is) between nodes.
+  void packed(wire_reader in, int f, wire_buffer &out) {
+    m_packed.clear();
+    while (!in.at_end()) {
+      m_packed.varint(id(in.varint()));
+    }
+    out.packed(f, m_packed);
+  }
+
+  void dense(wire_reader in) {
+    m_dense.clear();
+    while (in.next()) {
+      const int f = in.field();
+      if (f == 5) {
+        dense_info(in.contents());
+        m_dense.field(f, m_info);
+      } else if (f == 10) {
+        packed(in.contents(), f, m_dense);
+      } else {
+        in.copy(m_dense);
+      }
+    }
+  }
 
-        write_blob(pblock, "OSMData");
-        pblock.Clear();
-        str_table.clear();
-        
-        m_current_element = type;
-        m_est_pblock_size = 0;
+  // the user_sid column is delta coded, so has to be decoded in full and
+  // the deltas worked out again for the new IDs. without user info, dense
+  // nodes all have a uid of zero and the empty string as user.
+  void dense_info(wire_reader in) {
+    m_info.clear();
+    while (in.next()) {
+      if (m_strip_users && ((in.field() == 4) || (in.field() == 5))) {
+        const int f = in.field();
+        wire_reader column = in.contents();
+        m_packed.clear();
+        for (bool first = true; !column.at_end(); first = false) {
+          column.varint();
+          m_packed.svarint(((f == 5) && first) ? int64_t(id(m_empty_sid)) : 0);
+        }
+        m_info.packed(f, m_packed);
+      } else if (in.field() == 5) {
+        wire_reader sids = in.contents();
+        int32_t last_old = 0, last_new = 0;
+        m_packed.clear();
+        while (!sids.at_end()) {
+          last_old += int32_t(sids.svarint());
+          m_packed.svarint(delta<int32_t>(last_new, int32_t(id(uint32_t(last_old)))));
+        }
+        m_info.packed(5, m_packed);
+      } else {
+        in.copy(m_info);
       }
+    }
+  }
+
+  const std::vector<uint32_t> *m_remap;
+  bool m_strip_users;
+  uint32_t m_empty_sid;
+  wire_buffer m_group, m_element, m_info, m_packed, m_dense;
+};
 
-      reset_dense_ids();
-      pgroup = pblock.add_primitivegroup();
-      num_elements = 0;
-      current_node = NULL;
-      current_way = NULL;
-      current_relation = NULL;
-      m_est_pgroup_sz = 0;
+/**
+ * steps through the tags or inners of a chunk in step with its elements,
+ * which are sorted in the same order.
+ */
+template <typename I>
+struct associated_cursor {
+  associated_cursor(const I *begin, const I *end) : m_itr(begin), m_end(end) {}
+
+  // the next tag or inner of the given version of an element, or null if
+  // there are no more. any before it, which belong to earlier elements or
+  // versions, are skipped.
+  const I *next(int64_t id, int64_t version) {
+    while ((m_itr != m_end) &&
+           ((owner_of(*m_itr) < id) ||
+            ((owner_of(*m_itr) == id) && (m_itr->version <= version)))) {
+      const I *i = m_itr++;
+      if ((owner_of(*i) == id) && (i->version == version)) {
+        return i;
+      }
     }
+    return NULL;
   }
 
-  void check_dense_node_arrays() const {
-    ASSERT_EQ(m_dense_nodes, true);
-    ASSERT_NOT_NULL(m_dense_section);
+  const I *position() const { return m_itr; }
+
+private:
+  static int64_t owner_of(const old_tag &t) { return t.element_id; }
+  static int64_t owner_of(const way_node &wn) { return wn.way_id; }
+  static int64_t owner_of(const relation_member &rm) { return rm.relation_id; }
+
+  const I *m_itr, *m_end;
+};
+
+// nodes don't have any inners.
+template <>
+struct associated_cursor<int> {
+  associated_cursor(const int *, const int *) {}
+  const int *next(int64_t, int64_t) { return NULL; }
+  const int *position() const { return NULL; }
+};
+
+/**
+ * the elements of one block, and their tags and inners, which point into
+ * either a chunk passed to the writer or the writer's own copy of some.
+ */
+template <typename T>
+struct element_slice {
+  typedef typename T::inner_type inner_type;
+
+  const T *elements, *elements_end;
+  const old_tag *tags, *tags_end;
+  const inner_type *inners, *inners_end;
+};
 
-    const OSMPBF::DenseInfo *info = m_dense_section->mutable_denseinfo();
-    ASSERT_NOT_NULL(info);
+/**
+ * the options which every block of an output is encoded with.
+ */
+struct block_settings {
+  historical_versions history;
+  // the block_variants which are written.
+  unsigned int variants;
+  bool dense_nodes;
+  // the locations of the nodes, to add to the ways, or null if they're not
+  // added.
+  const node_locations *locations;
+};
 
-    const int num_ids = m_dense_section->id_size();
-    const int num_lons = m_dense_section->lon_size();
-    const int num_lats = m_dense_section->lat_size();
-    const int num_versions = info->version_size();
-    const int num_timestamps = info->timestamp_size();
-    const int num_changesets = info->changeset_size();
-    const int num_visibles = info->visible_size();
-    const int num_uids = info->uid_size();
-    const int num_user_sids = info->user_sid_size();
+/**
+ * encodes a whole PrimitiveBlock from a slice of elements. each block has
+ * its own string table and delta bases, so blocks can be encoded on any
+ * thread and in any order.
+ *
+ * with a wire_counter as the buffer, this is a block_sizer, which keeps
+ * track of the exact size that the block would be as elements are added,
+ * but doesn't encode them.
+ */
+template <typename Buffer>
+struct basic_block_encoder : private boost::noncopyable {
+  explicit basic_block_encoder(const block_settings &settings)
+    : m_settings(settings), m_strings(settings.variants), m_group(), m_remap(), m_renumber(),
+      m_empty_sid(0) {}
 
-    ASSERT_EQ(num_ids, num_lons);
-    ASSERT_EQ(num_ids, num_lats);
-    ASSERT_EQ(num_ids, num_versions);
-    ASSERT_EQ(num_ids, num_timestamps);
-    ASSERT_EQ(num_ids, num_changesets);
-    if (m_historical_versions == historical_versions::FULL) {
-      ASSERT_EQ(num_ids, num_visibles);
+  template <typename T>
+  void add(const element_slice<T> &slice) {
+    associated_cursor<old_tag> tags(slice.tags, slice.tags_end);
+    associated_cursor<typename T::inner_type> inners(slice.inners, slice.inners_end);
+    for (const T *e = slice.elements; e != slice.elements_end; ++e) {
+      add(*e, tags, inners);
     }
-    ASSERT_EQ(num_ids, num_uids);
-    ASSERT_EQ(num_ids, num_user_sids);
   }
 
-  template <typename T>
-  void set_info(const T &t, OSMPBF::Info *info) {
-    static bt::ptime epoch = bt::from_time_t(time_t(0));
-    
-    info->set_version(t.version);
-    info->set_timestamp((t.timestamp - epoch).total_seconds());
-    info->set_changeset(t.changeset_id);
-    // if we are doing a history file, and the default of visible=true
-    // doesn't apply, then we need to explicitly set visible=false.
-    if ((m_historical_versions == historical_versions::FULL) && !t.visible) {
-      info->set_visible(t.visible);
-    }
-    // set the uid and user information, if the user is public
-    user_map_t::const_iterator jtr = m_user_map.end();
-    if (m_user_info_level == user_info_level::FULL) {
-      std::map<int64_t, int64_t>::const_iterator itr = m_changeset_user_map.find(t.changeset_id);
-      if (itr == m_changeset_user_map.end()) {
-        std::ostringstream out;
-        out << "Unable to find changeset " << t.changeset_id
-            << " in changeset-to-user map.";
-        BOOST_THROW_EXCEPTION(std::runtime_error(out.str()));
+  // add an element, with its tags and inners, which the cursors are moved
+  // past.
+  void add(const node &n, associated_cursor<old_tag> &tags, associated_cursor<int> &) {
+    add_node(n);
+    if (n.visible) {
+      while (const old_tag *t = tags.next(n.id, n.version)) {
+        add_tag(*t, true);
       }
-      jtr = m_user_map.find(itr->second);
     }
-    if (jtr != m_user_map.end()) {
-      info->set_uid(jtr->first);
-      info->set_user_sid(str_table(jtr->second));
-    } else {
-      // for anonymous or no user info, just leave the uid & user_sid blank.
+    if (m_settings.dense_nodes) { m_group.finish_dense_node(); }
+  }
+
+  void add(const way &w, associated_cursor<old_tag> &tags, associated_cursor<way_node> &nds) {
+    m_group.add_way(w.id, info_of(w));
+    if (!w.visible) { return; }
+    while (const way_node *wn = nds.next(w.id, w.version)) {
+      if (m_settings.locations != NULL) {
+        add_way_node_location(wn->node_id);
+      } else {
+        m_group.add_way_node(wn->node_id);
+      }
+    }
+    while (const old_tag *t = tags.next(w.id, w.version)) {
+      add_tag(*t, false);
     }
   }
 
-  void add_changeset(const changeset &cs) {
-    // looks like OSMPBF is broken and doesn't really support this.
-    check_overflow(element_CHANGESET);
+  void add(const relation &r, associated_cursor<old_tag> &tags, associated_cursor<relation_member> &members) {
+    m_group.add_relation(r.id, info_of(r));
+    if (!r.visible) { return; }
+    while (const relation_member *rm = members.next(r.id, r.version)) {
+      m_group.add_member(m_strings(rm->member_role), rm->member_id, member_type(rm->member_type));
+    }
+    while (const old_tag *t = tags.next(r.id, r.version)) {
+      add_tag(*t, false);
+    }
+  }
+
+  // the size of the block, as it would be written now, for the first of
+  // its variants. the string table and group both keep track of their
+  // exact encoded sizes as elements are added, so this is cheap enough to
+  // check for every element. renumbering the strings before the block is
+  // written only makes the string IDs smaller in total, give or take a few
+  // bytes in the dense nodes' user deltas.
+  size_t block_size() {
+    const block_variant v = (m_settings.variants & variant_with_users) ? variant_with_users : variant_without_users;
+    return field_size(m_strings.byte_size(v)) + field_size(m_group.byte_size());
+  }
+
+  // the serialised block, for each of the variants in turn. the group was
+  // encoded with string IDs in the order they were first seen, and is
+  // rewritten with them renumbered, most used first, for each variant.
+  void finish(std::vector<std::string> &raws) {
+    wire_buffer groups;
+    // each block has a single group, after the string table.
+    m_group.write(groups);
+
+    const block_variant variants[] = { variant_with_users, variant_without_users };
+    BOOST_FOREACH(block_variant v, variants) {
+      if ((m_settings.variants & v) == 0) { continue; }
+      // the user info only needs stripping out if it was encoded.
+      const bool strip_users = (v == variant_without_users) && (m_settings.variants & variant_with_users);
+      wire_buffer block;
+      m_strings.renumber(v, m_remap);
+      m_strings.write(v, block);
+      m_renumber(m_remap, groups, block, strip_users, m_empty_sid);
+      raws.push_back(std::string());
+      std::swap(raws.back(), block.str());
+    }
+  }
+
+private:
+  template <typename T>
+  element_info info_of(const T &t) {
+    static const bt::ptime epoch = bt::from_time_t(time_t(0));
+    element_info info;
+
+    info.version = t.version;
+    info.timestamp = (t.timestamp - epoch).total_seconds();
+    info.changeset = t.changeset_id;
+    // if we are doing a history file, and the default of visible=true
+    // doesn't apply, then we need to explicitly set visible=false.
+    info.has_visible = (m_settings.history == historical_versions::FULL) && !t.visible;
+    info.visible = t.visible;
+    // set the uid and user information, if the user is public. the user
+    // was resolved from the changeset in the join. for anonymous or no
+    // user info, just leave the uid & user_sid blank.
+    info.has_user = (m_settings.variants & variant_with_users) && (t.user != NULL);
+    info.uid = 0;
+    info.user_sid = 0;
+    if (info.has_user) {
+      info.uid = int32_t(t.user->id);
+      info.user_sid = m_strings(t.user);
+    }
+    return info;
   }
 
   void add_node(const node &n) {
-    check_overflow(element_NODE);
-    if (m_dense_nodes) return add_dense_node(n);
+    // deleted nodes don't have lat/lon attributes. however, PBF doesn't
+    // allow you not to set these attributes, so we have to set them to
+    // some null value. (0, 0) is, sadly, the traditional value for these,
+    // even though it is valid.
+    const int32_t lat = n.visible ? n.latitude : 0;
+    const int32_t lon = n.visible ? n.longitude : 0;
+    element_info info = info_of(n);
+
+    if (!m_settings.dense_nodes) {
+      m_group.add_node(n.id, lat, lon, info);
+      return;
+    }
 
-    current_node = pgroup->add_nodes();
-    current_node->set_id(n.id);
-    // deleted nodes don't have lat/lon attributes
-    if (n.visible) {
-      current_node->set_lat(n.latitude);
-      current_node->set_lon(n.longitude);
-    } else {
-      // however, PBF doesn't allow you not to set these attributes,
-      // so we have to set them to some null value. (0, 0) is, sadly,
-      // the traditional value for these, even though it is valid.
-      current_node->set_lat(0);
-      current_node->set_lon(0);
-    }
-    set_info(n, current_node->mutable_info());
-
-    ++num_elements;
-  }
-
-  void add_dense_node(const node &n) {
-    static bt::ptime epoch = bt::from_time_t(time_t(0));
-    current_node = NULL;
-    m_dense_section = pgroup->mutable_dense();
-    m_dense_section->add_id(delta<int64_t>(m_last_dense_id, n.id));
-    m_dense_section->add_lon(delta<int64_t>(m_last_dense_lon, n.visible ? n.longitude : 0));
-    m_dense_section->add_lat(delta<int64_t>(m_last_dense_lat, n.visible ? n.latitude : 0));
-    OSMPBF::DenseInfo* info = m_dense_section->mutable_denseinfo();
-    info->add_version(n.version);
-    info->add_timestamp(delta<int64_t>(m_last_dense_timestamp, (n.timestamp - epoch).total_seconds()));
-    info->add_changeset(delta<int64_t>(m_last_dense_changeset, n.changeset_id));
     // if we are doing a history file, we need to set the visible flag
     // for all entries in the dense node table, as this array is indexed
     // into by position to get the visibility flag.
-    if (m_historical_versions == historical_versions::FULL) {
-      info->add_visible(n.visible);
-    }
-    // set the uid and user information, if the user is public
-    std::map<int64_t, int64_t>::const_iterator itr = m_changeset_user_map.end();
-    user_map_t::const_iterator jtr = m_user_map.end();
-    if (m_user_info_level == user_info_level::FULL) {
-      itr = m_changeset_user_map.find(n.changeset_id);
-      if (itr == m_changeset_user_map.end()) {
-        std::ostringstream out;
-        out << "Unable to find changeset " << n.changeset_id 
-            << " in changeset-to-user map for dense node.";
-        BOOST_THROW_EXCEPTION(std::runtime_error(out.str()));
-      }
-      jtr = m_user_map.find(itr->second);
-    }
-    if (jtr != m_user_map.end()) {
-      info->add_uid(delta<int32_t>(m_last_dense_uid, jtr->first));
-      info->add_user_sid(delta<int32_t>(m_last_dense_user_sid, str_table(jtr->second)));
-    }
-    else
-    {
+    info.has_visible = (m_settings.history == historical_versions::FULL);
+    if (!info.has_user) {
       // anonymous user - note that the array requires a value, but
       // it doesn't appear to be documented anywhere what the "null"
       // value should be. apparently -1 is no good, so use 0.
-      info->add_uid(delta<int32_t>(m_last_dense_uid, 0));
-      info->add_user_sid(delta<int32_t>(m_last_dense_user_sid, str_table("")));
+      info.uid = 0;
+      info.user_sid = m_strings("");
+      m_empty_sid = info.user_sid;
+
+    } else if (m_settings.variants & variant_without_users) {
+      // every node is anonymous in the variant without user info.
+      m_empty_sid = m_strings("", variant_without_users);
+    }
+    m_group.add_dense_node(n.id, lat, lon, info);
+  }
+
+  // nodes which aren't in the planet, which shouldn't happen but could
+  // after a redaction, get the same undefined location as libosmium uses.
+  void add_way_node_location(int64_t ref) {
+    int32_t lat = std::numeric_limits<int32_t>::max();
+    int32_t lon = std::numeric_limits<int32_t>::max();
+    m_settings.locations->find(ref, lat, lon);
+    m_group.add_way_node(ref, lat, lon);
+  }
+
+  void add_tag(const old_tag &t, bool node_section) {
+    // the key and value are looked up in order, so that they get string
+    // IDs in the order they're first seen.
+    const int key = m_strings(t.key);
+    const int val = m_strings(t.value);
+    if (m_settings.dense_nodes && node_section) {
+      m_group.add_dense_tag(key, val);
+    } else {
+      m_group.add_tag(key, val);
+    }
+  }
+
+  static OSMPBF::Relation::MemberType member_type(nwr_enum type) {
+    switch (type) {
+    case nwr_node:
+      return OSMPBF::Relation::NODE;
+
+    case nwr_way:
+      return OSMPBF::Relation::WAY;
+      
+    case nwr_relation:
+      return OSMPBF::Relation::RELATION;
     }
-    ++num_elements;
+
+    BOOST_THROW_EXCEPTION(std::runtime_error("Unknown nwr_enum value in member_type."));
+  }
+
+  const block_settings m_settings;
+  string_table m_strings;
+  basic_group_encoder<Buffer> m_group;
+  std::vector<uint32_t> m_remap;
+  string_renumberer m_renumber;
+  // the ID of the empty string, which dense nodes without a user have.
+  uint32_t m_empty_sid;
+};
+
+typedef basic_block_encoder<wire_buffer> block_encoder;
+typedef basic_block_encoder<wire_counter> block_sizer;
+
+// encode a slice of elements as a serialised block for each variant, on
+// a pipeline worker.
+template <typename T>
+void encode_slice(const block_settings &settings, const element_slice<T> &slice, std::vector<std::string> &raws) {
+  block_encoder encoder(settings);
+  encoder.add(slice);
+  encoder.finish(raws);
+}
+
+/**
+ * the codec, and level for it, which PBF blobs are compressed with.
+ */
+struct blob_compression {
+  enum codec_type {
+    codec_none,
+    codec_zlib,
+    codec_zstd,
+    codec_lz4
+  };
+
+  codec_type codec;
+  int level;
+};
+
+void check_level(const std::string &name, int level, int min_level, int max_level) {
+  if ((level < min_level) || (level > max_level)) {
+    BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("PBF compression level %1% is out of range for %2%, which must be between %3% and %4%.") % level % name % min_level % max_level).str()));
   }
+}
+
+blob_compression compression_options(const boost::program_options::variables_map &options) {
+  const std::string name = options["pbf-compression"].as<std::string>();
+  const bool has_level = options.count("pbf-compression-level") > 0;
+  const int level = has_level ? options["pbf-compression-level"].as<int>() : 0;
+  blob_compression c;
 
-  void add_way(const way &w) {
-    check_overflow(element_WAY);
+  if (name == "none") {
+    if (has_level) {
+      BOOST_THROW_EXCEPTION(std::runtime_error("PBF compression level can't be set when PBF compression is none."));
+    }
+    c.codec = blob_compression::codec_none;
+    c.level = 0;
+
+  } else if (name == "zlib") {
+    c.codec = blob_compression::codec_zlib;
+    c.level = has_level ? level : Z_BEST_COMPRESSION;
+    check_level(name, c.level, Z_NO_COMPRESSION, Z_BEST_COMPRESSION);
+
+  } else if (name == "zstd") {
+#ifdef WITH_ZSTD
+    c.codec = blob_compression::codec_zstd;
+    c.level = has_level ? level : ZSTD_CLEVEL_DEFAULT;
+    check_level(name, c.level, 1, ZSTD_maxCLevel());
+#else
+    BOOST_THROW_EXCEPTION(std::runtime_error("PBF compression zstd isn't supported by this build of planet-dump-ng."));
+#endif
 
-    current_way = pgroup->add_ways();
-    current_way->set_id(w.id);
-    set_info(w, current_way->mutable_info());
+  } else if (name == "lz4") {
+#ifdef WITH_LZ4
+    // level zero is lz4's fast mode, and higher levels use lz4hc.
+    c.codec = blob_compression::codec_lz4;
+    c.level = has_level ? level : 0;
+    check_level(name, c.level, 0, LZ4HC_CLEVEL_MAX);
+#else
+    BOOST_THROW_EXCEPTION(std::runtime_error("PBF compression lz4 isn't supported by this build of planet-dump-ng."));
+#endif
 
-    m_last_way_node_ref = 0;
-    ++num_elements;
+  } else {
+    BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unknown PBF compression '%1%', expected one of none, zlib, zstd or lz4.") % name).str()));
   }
 
-  void add_relation(const relation &r) {
-    check_overflow(element_RELATION);
+  return c;
+}
+
+// sanity check - if we're about to violate the OSMPBF format rules then
+// we'd rather stop than ship an invalid file.
+void check_block_size(const std::string &type, size_t uncompressed_size) {
+  if (uncompressed_size >= OSMPBF::max_uncompressed_blob_size) {
+    std::ostringstream ostr;
+    ostr << "Unable to write block of type " << type << ", uncompressed size " << uncompressed_size
+         << " because it is larger than the maximum allowed " << OSMPBF::max_uncompressed_blob_size
+         << "." << std::endl;
+    BOOST_THROW_EXCEPTION(std::runtime_error(ostr.str()));
+  }
+}
 
-    current_relation = pgroup->add_relations();
-    current_relation->set_id(r.id);
-    set_info(r, current_relation->mutable_info());
-    // relation tag + submessage len 1+2?
-    // id ~ 4+1 bytes? (+1 for tag)
-    // info len + tag = 1+1
-    // version ~ 1+1 byte
-    // changeset ID ~ 4+1 bytes?
-    // timestamp ~ 4+1 bytes?
-    // user ID 3+1 & string table user name 2 + 1 bytes?
-    m_est_pgroup_sz += 29;
+/**
+ * encodes and compresses blobs on a pool of worker threads and writes them
+ * to the outputs in the order in which they were submitted. a blob is either
+ * serialised by the caller, or submitted as a function which serialises it
+ * on the worker. such functions may refer to the caller's data, which must
+ * be kept until wait_encoded() returns.
+ *
+ * each job writes one blob to each of the outputs, so that files which
+ * differ only in the variant of their blocks can be encoded together.
+ *
+ * the workers are only started when the first blob is submitted. with no
+ * workers, blobs are encoded, compressed and written by the caller.
+ */
+struct blob_pipeline : private boost::noncopyable {
+  blob_pipeline(const std::vector<std::ostream *> &outs, unsigned int num_threads,
+                const blob_compression &compression)
+    : m_outs(outs), m_num_threads(num_threads), m_compression(compression),
+      m_capacity(2 * size_t(num_threads)),
+      m_num_encoding(0), m_writing(false), m_shutdown(false) {
+  }
 
-    m_last_relation_member_ref = 0;
-    ++num_elements;
+  ~blob_pipeline() {
+    {
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      m_shutdown = true;
+      m_cond.notify_all();
+    }
+    m_threads.join_all();
   }
 
-  void add_dense_tag(const old_tag &t) {
-    if (m_dense_section== NULL) {
-      BOOST_THROW_EXCEPTION(std::runtime_error("No dense section available for tag."));
+  // submit a serialised block of the given type, the same for all the
+  // outputs. the contents of raw are taken by the pipeline. rethrows any
+  // error from an earlier blob.
+  void submit(const std::string &type, std::string &raw) {
+    boost::shared_ptr<job> j = boost::make_shared<job>();
+    j->type = type;
+    j->done = false;
+    j->data.resize(m_outs.size());
+    for (size_t i = 1; i < j->data.size(); ++i) {
+      j->data[i] = raw;
     }
-    m_dense_section->add_keys_vals(str_table(t.key));
-    m_dense_section->add_keys_vals(str_table(t.value));
+    std::swap(j->data[0], raw);
+    submit(j);
   }
 
-  void add_node_finish() {
-    if (m_dense_nodes) m_dense_section->add_keys_vals(0);
+  // submit a block of the given type, which is serialised by calling
+  // encode, which appends the serialised block for each output in turn.
+  void submit(const std::string &type, const boost::function<void (std::vector<std::string> &)> &encode) {
+    boost::shared_ptr<job> j = boost::make_shared<job>();
+    j->type = type;
+    j->done = false;
+    j->encode = encode;
+    submit(j);
   }
 
-  void add_tag(const old_tag &t, bool node_section) {
-    if (m_dense_nodes && node_section) return add_dense_tag(t);
-    if (m_current_element == element_NULL) {
-      BOOST_THROW_EXCEPTION(std::runtime_error("Tag for NULL element type."));
+  // wait until all the submitted blobs have been encoded, so that any
+  // data they refer to can be released. errors are left for the next call
+  // to submit() or flush().
+  void wait_encoded() {
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    while (m_num_encoding > 0) {
+      m_cond.wait(lock);
+    }
+  }
 
-    } else if (m_current_element == element_CHANGESET) {
-      // OSMPBF brokenness - do nothing here.
+  // wait until all the submitted blobs have been written out, rethrowing
+  // any error from compressing or writing them.
+  void flush() {
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    while ((!m_pending.empty() || m_writing) && !m_error) {
+      m_cond.wait(lock);
+    }
+    if (m_error) {
+      boost::rethrow_exception(m_error);
+    }
+  }
 
-    } else if (m_current_element == element_NODE) {
-      if (current_node == NULL) { BOOST_THROW_EXCEPTION(std::runtime_error("Tag before node? oops.")); }
-      current_node->add_keys(str_table(t.key));
-      current_node->add_vals(str_table(t.value));
+private:
+  struct job {
+    std::string type;
+    // serialises the block, if it wasn't serialised when submitted.
+    boost::function<void (std::vector<std::string> &)> encode;
+    // the serialised block for each output, and then the framed blob once
+    // compressed.
+    std::vector<std::string> data;
+    bool done;
+  };
 
-    } else if (m_current_element == element_WAY) {
-      if (current_way == NULL) { BOOST_THROW_EXCEPTION(std::runtime_error("Tag before way? oops.")); }
-      current_way->add_keys(str_table(t.key));
-      current_way->add_vals(str_table(t.value));
+  void submit(boost::shared_ptr<job> j) {
+    if (m_num_threads == 0) {
+      encode(*j);
+      compress(*j);
+      write(*j);
+      return;
+    }
 
-    } else if (m_current_element == element_RELATION) {
-      if (current_relation == NULL) { BOOST_THROW_EXCEPTION(std::runtime_error("Tag before relation? oops.")); }
-      current_relation->add_keys(str_table(t.key));
-      current_relation->add_vals(str_table(t.value));
-      // keys & vals ~ 2 bytes each?
-      m_est_pgroup_sz += 4;
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    if (m_threads.size() == 0) {
+      for (unsigned int i = 0; i < m_num_threads; ++i) {
+        m_threads.create_thread(boost::bind(&blob_pipeline::run, this));
+      }
+    }
+    while ((m_pending.size() >= m_capacity) && !m_error) {
+      m_cond.wait(lock);
+    }
+    if (m_error) {
+      boost::rethrow_exception(m_error);
     }
+    if (j->encode) {
+      ++m_num_encoding;
+    }
+    m_pending.push_back(j);
+    m_todo.push_back(j);
+    m_cond.notify_all();
   }
 
-  void add_way_node(const way_node &wn) {
-    if (m_current_element != element_WAY) { BOOST_THROW_EXCEPTION(std::runtime_error("Unexpected way node.")); }
-    current_way->add_refs(int64_t(wn.node_id) - m_last_way_node_ref);
-    m_last_way_node_ref = wn.node_id;
+  void run() {
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    while (true) {
+      while (m_todo.empty() && !m_shutdown) {
+        m_cond.wait(lock);
+      }
+      if (m_shutdown) { return; }
+
+      boost::shared_ptr<job> j = m_todo.front();
+      m_todo.pop_front();
+
+      lock.unlock();
+      const bool encoding = bool(j->encode);
+      boost::exception_ptr error;
+      try {
+        encode(*j);
+      } catch (...) {
+        error = boost::current_exception();
+      }
+      if (encoding) {
+        lock.lock();
+        --m_num_encoding;
+        m_cond.notify_all();
+        lock.unlock();
+      }
+      if (!error) {
+        try {
+          compress(*j);
+        } catch (...) {
+          error = boost::current_exception();
+        }
+      }
+      lock.lock();
+      j->done = true;
+
+      // only one worker writes at a time, and it writes out all the blobs
+      // at the front of the queue which are ready, in order.
+      while (!error && !m_error && !m_writing &&
+             !m_pending.empty() && m_pending.front()->done) {
+        boost::shared_ptr<job> w = m_pending.front();
+        m_pending.pop_front();
+        m_writing = true;
+        lock.unlock();
+        try {
+          write(*w);
+        } catch (...) {
+          error = boost::current_exception();
+        }
+        lock.lock();
+        m_writing = false;
+      }
+
+      if (error && !m_error) {
+        m_error = error;
+      }
+      m_cond.notify_all();
+    }
   }
 
-  OSMPBF::Relation::MemberType member_type(nwr_enum type) {
-    switch (type) {
-    case nwr_node:
-      return OSMPBF::Relation::NODE;
+  // serialise the block, if that's still to be done. the function is
+  // dropped afterwards, along with anything it holds on to.
+  void encode(job &j) {
+    if (j.encode) {
+      boost::function<void (std::vector<std::string> &)> fn;
+      fn.swap(j.encode);
+      fn(j.data);
+    }
+    BOOST_FOREACH(const std::string &data, j.data) {
+      check_block_size(j.type, data.size());
+    }
+  }
 
-    case nwr_way:
-      return OSMPBF::Relation::WAY;
-      
-    case nwr_relation:
-      return OSMPBF::Relation::RELATION;
+  void compress(job &j) const {
+    BOOST_FOREACH(std::string &data, j.data) {
+      compress(j.type, data);
     }
+  }
 
-    BOOST_THROW_EXCEPTION(std::runtime_error("Unknown nwr_enum value in member_type."));
+  // compress the serialised block, and replace it with the whole of the
+  // blob as it will be written to the file: the length of the header, the
+  // header and then the blob.
+  void compress(const std::string &type, std::string &data) const {
+    using namespace OSMPBF;
+
+    Blob blob;
+    switch (m_compression.codec) {
+    case blob_compression::codec_none:
+      // raw_size is only for compressed data, so isn't set here.
+      blob.set_raw(data);
+      break;
+
+    case blob_compression::codec_zlib: {
+      blob.set_raw_size(data.size());
+      uLongf compressed_size = compressBound(data.size());
+      std::string *zlib_data = blob.mutable_zlib_data();
+      zlib_data->resize(compressed_size);
+      const int status = compress2((Bytef *)&(*zlib_data)[0], &compressed_size,
+                                   (const Bytef *)data.data(), data.size(), m_compression.level);
+      if (status != Z_OK) {
+        std::ostringstream ostr;
+        ostr << "Unable to compress block of type " << type << ", zlib error " << status << ".";
+        BOOST_THROW_EXCEPTION(std::runtime_error(ostr.str()));
+      }
+      zlib_data->resize(compressed_size);
+      break;
+    }
+
+#ifdef WITH_ZSTD
+    case blob_compression::codec_zstd: {
+      blob.set_raw_size(data.size());
+      std::string *zstd_data = blob.mutable_zstd_data();
+      zstd_data->resize(ZSTD_compressBound(data.size()));
+      const size_t compressed_size = ZSTD_compress(&(*zstd_data)[0], zstd_data->size(),
+                                                   data.data(), data.size(), m_compression.level);
+      if (ZSTD_isError(compressed_size)) {
+        std::ostringstream ostr;
+        ostr << "Unable to compress block of type " << type << ", zstd error: "
+             << ZSTD_getErrorName(compressed_size) << ".";
+        BOOST_THROW_EXCEPTION(std::runtime_error(ostr.str()));
+      }
+      zstd_data->resize(compressed_size);
+      break;
+    }
+#endif
+
+#ifdef WITH_LZ4
+    case blob_compression::codec_lz4: {
+      // blocks are limited to max_uncompressed_blob_size, so fit in an int.
+      blob.set_raw_size(data.size());
+      std::string *lz4_data = blob.mutable_lz4_data();
+      lz4_data->resize(LZ4_compressBound(int(data.size())));
+      const int compressed_size = (m_compression.level > 0)
+        ? LZ4_compress_HC(data.data(), &(*lz4_data)[0], int(data.size()), int(lz4_data->size()), m_compression.level)
+        : LZ4_compress_default(data.data(), &(*lz4_data)[0], int(data.size()), int(lz4_data->size()));
+      if (compressed_size <= 0) {
+        std::ostringstream ostr;
+        ostr << "Unable to compress block of type " << type << " with lz4.";
+        BOOST_THROW_EXCEPTION(std::runtime_error(ostr.str()));
+      }
+      lz4_data->resize(compressed_size);
+      break;
+    }
+#endif
+
+    default:
+      BOOST_THROW_EXCEPTION(std::runtime_error("Unsupported PBF compression codec."));
+    }
+
+    BlobHeader blob_header;
+    blob_header.set_type(type);
+    blob_header.set_datasize(blob.ByteSizeLong());
+
+    int blob_header_size = blob_header.ByteSizeLong();
+    if (blob_header_size < 0) {
+      std::ostringstream ostr;
+      ostr << "Unable to write blob header size " << blob_header_size 
+           << " because it will not correctly cast to uint32_t.";
+      BOOST_THROW_EXCEPTION(std::runtime_error(ostr.str()));
+    }
+    uint32_t bh_size = htonl(uint32_t(blob_header_size));
+
+    std::string framed;
+    framed.reserve(sizeof bh_size + blob_header_size + blob.ByteSizeLong());
+    framed.append((const char *)&bh_size, sizeof bh_size);
+    blob_header.AppendToString(&framed);
+    blob.AppendToString(&framed);
+    std::swap(data, framed);
+  }
+
+  void write(const job &j) {
+    for (size_t i = 0; i < m_outs.size(); ++i) {
+      m_outs[i]->write(j.data[i].data(), j.data[i].size());
+      m_outs[i]->flush();
+    }
   }
 
-  void add_relation_member(const relation_member &rm) {
-    if (m_current_element != element_RELATION) { BOOST_THROW_EXCEPTION(std::runtime_error("Unexpected relation member.")); }
-    current_relation->add_roles_sid(str_table(rm.member_role));
-    current_relation->add_memids(int64_t(rm.member_id) - m_last_relation_member_ref);
-    current_relation->add_types(member_type(rm.member_type));
-    m_last_relation_member_ref = rm.member_id;
-    // role = string in string table, so maybe 1 byte on average?
-    // member ID, diff to previous ~ 2 bytes?
-    // member type ~ 1 byte?
-    m_est_pgroup_sz += 4;
+  const std::vector<std::ostream *> m_outs;
+  const unsigned int m_num_threads;
+  const blob_compression m_compression;
+  // the most blobs which can be waiting to be compressed or written before
+  // submit() waits, to bound the memory used.
+  const size_t m_capacity;
+  boost::thread_group m_threads;
+  // the number of submitted blobs which are still to be serialised.
+  size_t m_num_encoding;
+  // blobs not yet written, in the order they were submitted, and those not
+  // yet picked up by a worker to compress.
+  std::deque<boost::shared_ptr<job> > m_pending, m_todo;
+  bool m_writing, m_shutdown;
+  boost::exception_ptr m_error;
+  boost::mutex m_mutex;
+  boost::condition_variable m_cond;
+};
+
+/**
+ * the elements at the end of a chunk which didn't fill a block, copied so
+ * that they can go in the same block as those at the start of the next.
+ */
+template <typename T>
+struct pending_chunk {
+
+  element_slice<T> slice() const {
+    element_slice<T> s = {
+      elements.data(), elements.data() + elements.size(),
+      tags.data(), tags.data() + tags.size(),
+      inners.data(), inners.data() + inners.size()
+    };
+    return s;
+  }
+
+  // swap the elements, tags and inners, but not the sizer.
+  void swap(pending_chunk<T> &other) {
+    elements.swap(other.elements);
+    tags.swap(other.tags);
+    inners.swap(other.inners);
+  }
+
+  std::vector<T> elements;
+  std::vector<old_tag> tags;
+  std::vector<typename T::inner_type> inners;
+  // the size of the block being cut, which these elements start, and any
+  // elements after them that have been added to it.
+  boost::scoped_ptr<block_sizer> sizer;
+};
+
+struct pending_chunks {
+  pending_chunk<node> nodes;
+  pending_chunk<way> ways;
+  pending_chunk<relation> relations;
+};
+
+template <typename T> pending_chunk<T> &pending_of(pending_chunks &);
+
+template <> inline pending_chunk<node> &pending_of<node>(pending_chunks &p) { return p.nodes; }
+template <> inline pending_chunk<way> &pending_of<way>(pending_chunks &p) { return p.ways; }
+template <> inline pending_chunk<relation> &pending_of<relation>(pending_chunks &p) { return p.relations; }
+
+template <typename T>
+void encode_pending(const block_settings &settings, boost::shared_ptr<const pending_chunk<T> > pending,
+                    std::vector<std::string> &raws) {
+  encode_slice<T>(settings, pending->slice(), raws);
+}
+
+// waits, when it goes out of scope, until the blocks which refer to a
+// chunk have been encoded, so that the chunk can be released - even if
+// there was an error cutting it into blocks.
+struct encoded_barrier : private boost::noncopyable {
+  explicit encoded_barrier(blob_pipeline &blobs) : m_blobs(blobs) {}
+  ~encoded_barrier() { m_blobs.wait_encoded(); }
+
+private:
+  blob_pipeline &m_blobs;
+};
+
+block_settings settings_of(historical_versions hv, unsigned int variants, bool dense_nodes,
+                           const node_locations *locations) {
+  block_settings settings;
+  settings.history = hv;
+  settings.variants = variants;
+  settings.dense_nodes = dense_nodes;
+  settings.locations = locations;
+  return settings;
+}
+
+// blocks are cut by the size of the first variant that they're written
+// in, which is the one with user info if that's written at all. the
+// variant without it is the same block with the user info taken out, so
+// is never larger, and is cut in the same places.
+block_settings sizing_settings_of(const block_settings &settings) {
+  block_settings sizing = settings;
+  if (sizing.variants & variant_with_users) {
+    sizing.variants = variant_with_users;
+  }
+  return sizing;
+}
+
+// the store of node locations for the ways, if they're wanted. ways only
+// have one set of nodes in a planet without history.
+boost::shared_ptr<node_locations> locations_for(const std::string &out_name, historical_versions hv,
+                                                const boost::program_options::variables_map &options) {
+  boost::shared_ptr<node_locations> locations;
+  if ((hv == historical_versions::NONE) && options["pbf-locations-on-ways"].as<bool>()) {
+    locations = boost::make_shared<node_locations>(out_name + ".node-locations");
+  }
+  return locations;
+}
+
+unsigned int variant_of(user_info_level uil) {
+  return (uil == user_info_level::FULL) ? variant_with_users : variant_without_users;
+}
+
+// open the output files, one for each variant written.
+std::vector<boost::shared_ptr<std::ofstream> > open_outputs(const std::vector<std::string> &names) {
+  std::vector<boost::shared_ptr<std::ofstream> > outs;
+  BOOST_FOREACH(const std::string &name, names) {
+    outs.push_back(boost::make_shared<std::ofstream>(name.c_str()));
+  }
+  return outs;
+}
+
+std::vector<std::ostream *> streams_of(const std::vector<boost::shared_ptr<std::ofstream> > &outs) {
+  std::vector<std::ostream *> streams;
+  BOOST_FOREACH(const boost::shared_ptr<std::ofstream> &out, outs) {
+    streams.push_back(out.get());
+  }
+  return streams;
+}
+
+} // anonymous namespace
+
+struct pbf_writer::pimpl {
+  // writes a file for each of the given variants, in the order in which
+  // they're numbered.
+  pimpl(const std::vector<std::string> &out_names, const bt::ptime &now, unsigned int variants,
+        historical_versions hv, const boost::program_options::variables_map &options)
+    : m_out_names(out_names), m_outs(open_outputs(out_names)),
+      m_locations(locations_for(out_names[0], hv, options)), m_owns_locations(true),
+      m_settings(settings_of(hv, variants, options["dense-nodes"].as<bool>(), m_locations.get())),
+      m_byte_limit(size_t(0.125 * OSMPBF::max_uncompressed_blob_size)),
+      m_pending(),
+      m_generator_name(options["generator"].as<std::string>()),
+      m_source_name(options["meta-source"].as<std::string>()),
+      m_compression_threads(options["pbf-compression-threads"].as<unsigned int>()),
+      m_compression(compression_options(options)),
+      m_blobs(new blob_pipeline(streams_of(m_outs), m_compression_threads, m_compression)) {
+    write_header_block(now);
+  }
+
+  // a section writer shares the parent's configuration, but writes only
+  // data blocks to its own files, one for each of the parent's.
+  pimpl(const std::vector<std::string> &out_names, const pimpl &parent)
+    : m_out_names(out_names), m_outs(open_outputs(out_names)),
+      m_locations(parent.m_locations), m_owns_locations(false),
+      m_settings(parent.m_settings),
+      m_byte_limit(parent.m_byte_limit),
+      m_pending(),
+      m_generator_name(parent.m_generator_name),
+      m_source_name(parent.m_source_name),
+      m_compression_threads(parent.m_compression_threads),
+      m_compression(parent.m_compression),
+      m_blobs(new blob_pipeline(streams_of(m_outs), m_compression_threads, m_compression)) {
+  }
+
+  ~pimpl() {
+    // don't leave the writers of ways waiting for nodes which aren't coming.
+    if (m_owns_locations && m_locations) {
+      m_locations->abandon();
+    }
+  }
+
+  void write_header_block(const bt::ptime &now) {
+    using namespace OSMPBF;
+
+    HeaderBlock header;
+    HeaderBBox *bbox = header.mutable_bbox();
+    bbox->set_left  (-180L * lonlat_resolution);
+    bbox->set_right ( 180L * lonlat_resolution);
+    bbox->set_top   (  90L * lonlat_resolution);
+    bbox->set_bottom( -90L * lonlat_resolution);
+
+    header.add_required_features("OsmSchema-V" OSM_VERSION_TEXT);
+    if (m_settings.history == historical_versions::FULL) { 
+      header.add_required_features("HistoricalInformation");
+    }
+    if (m_settings.dense_nodes) {
+      header.add_required_features("DenseNodes");
+    }
+    header.add_optional_features("Has_Metadata");
+    header.add_optional_features("Sort.Type_then_ID");
+    if (m_settings.locations != NULL) {
+      header.add_optional_features("LocationsOnWays");
+    }
+    header.set_writingprogram(m_generator_name);
+    header.set_source(m_source_name);
+#ifndef WITH_OLD_OSMPBF
+    header.set_osmosis_replication_timestamp((now - bt::from_time_t(time_t(0))).total_seconds());
+#endif
+
+    std::string raw;
+    header.SerializeToString(&raw);
+    // compression and writing happen in the pipeline, in order.
+    m_blobs->submit("OSMHeader", raw);
+  }
+
+  // cut a chunk of elements into blocks, which are encoded, compressed and
+  // written by the pipeline. the exact size that each block will be once
+  // encoded is kept track of as its elements are added, and the block is
+  // cut as soon as it reaches the target size. only the slice of elements
+  // for the block is handed to the pipeline, to be encoded again for real.
+  // where blocks are cut doesn't depend on anything but the elements, not
+  // even how they were split into chunks. the elements at the end of the
+  // chunk which don't fill a block are kept back to start the next chunk's
+  // first block.
+  template <typename T>
+  void write_chunk(const std::vector<T> &elements,
+                   const std::vector<typename T::inner_type> &inners,
+                   const std::vector<old_tag> &tags) {
+    typedef typename T::inner_type inner_type;
+
+    // blocks only have one type of element in them.
+    pending_chunk<T> &pending = pending_of<T>(m_pending);
+    submit_pending_except(&pending);
+    update_locations(elements);
+    if (!pending.sizer) {
+      start_block(pending);
+    }
+
+    encoded_barrier barrier(*m_blobs);
+    associated_cursor<old_tag> tag_cursor(tags.data(), tags.data() + tags.size());
+    associated_cursor<inner_type> inner_cursor(inners.data(), inners.data() + inners.size());
+    element_slice<T> slice = {
+      elements.data(), elements.data(),
+      tags.data(), tags.data(),
+      inners.data(), inners.data()
+    };
+
+    for (const T *e = elements.data(); e != elements.data() + elements.size(); ++e) {
+      const old_tag *tag = tag_cursor.position();
+      const inner_type *inner = inner_cursor.position();
+      pending.sizer->add(*e, tag_cursor, inner_cursor);
+
+      // until the kept back elements fill their block, this chunk's
+      // elements are copied to go with them.
+      if (!pending.elements.empty()) {
+        pending.elements.push_back(*e);
+        pending.tags.insert(pending.tags.end(), tag, tag_cursor.position());
+        pending.inners.insert(pending.inners.end(), inner, inner_cursor.position());
+        slice.elements = e + 1;
+        slice.tags = tag_cursor.position();
+        slice.inners = inner_cursor.position();
+      }
+
+      // the block can go over the target by up to one element, which is far
+      // smaller than the gap between the target and the maximum block size.
+      if (pending.sizer->block_size() >= m_byte_limit) {
+        if (pending.elements.empty()) {
+          slice.elements_end = e + 1;
+          slice.tags_end = tag_cursor.position();
+          slice.inners_end = inner_cursor.position();
+          m_blobs->submit("OSMData", boost::bind(&encode_slice<T>, m_settings, slice, _1));
+          slice.elements = e + 1;
+          slice.tags = tag_cursor.position();
+          slice.inners = inner_cursor.position();
+        } else {
+          submit_pending(pending);
+        }
+        start_block(pending);
+      }
+    }
+
+    if (pending.elements.empty()) {
+      pending.elements.assign(slice.elements, elements.data() + elements.size());
+      pending.tags.assign(slice.tags, tag_cursor.position());
+      pending.inners.assign(slice.inners, inner_cursor.position());
+    }
   }
   
-  void finish() {
+  // the section files are given for each of the outputs.
+  void finish(const std::vector<std::vector<std::string> > &section_files) {
+    complete_locations();
     // flush out last remaining elements
-    check_overflow(element_NULL);
-    // and make sure it's all written out
-    out.flush();
-    // and finally close the file
-    out.close();
-  }
-
-  size_t num_elements;
-  std::ostringstream buffer;
-  std::ofstream out;
-  string_table str_table;
-  OSMPBF::PrimitiveBlock pblock;
-  OSMPBF::PrimitiveGroup *pgroup;
-  OSMPBF::Node *current_node;
-  OSMPBF::Way *current_way;
-  OSMPBF::Relation *current_relation;
-  const int m_byte_limit;
-  element_type m_current_element;
-  int64_t m_last_way_node_ref, m_last_relation_member_ref;
-  int m_est_pblock_size;
-  historical_versions m_historical_versions;
-  user_info_level m_user_info_level;
-  user_map_t m_user_map;
-  bool m_dense_nodes;
-  OSMPBF::DenseNodes* m_dense_section;
-  std::map<int64_t, int64_t> m_changeset_user_map;
-  std::vector<size_t> m_recheck_elements;
+    submit_pending_except(NULL);
+    // wait for all this writer's blobs to be compressed and written.
+    m_blobs->flush();
+    for (size_t i = 0; i < m_outs.size(); ++i) {
+      std::ofstream &out = *m_outs[i];
+      // blobs are independent, so the sections can just be appended after
+      // the ones this writer has already written.
+      BOOST_FOREACH(const std::string &section_file, section_files[i]) {
+        append_section_file(out, section_file);
+      }
+      // and make sure it's all written out
+      out.flush();
+      // and finally close the file
+      out.close();
+    }
+  }
+
+  std::vector<std::string> m_out_names;
+  std::vector<boost::shared_ptr<std::ofstream> > m_outs;
+  // the node locations, shared with the section writers. the writer which
+  // writes the nodes owns them, and completes them when it's done.
+  boost::shared_ptr<node_locations> m_locations;
+  bool m_owns_locations;
+  const block_settings m_settings;
+  // the size to which blocks are filled before starting a new one.
+  const size_t m_byte_limit;
+  // the elements which didn't fill a block at the end of the last chunk.
+  pending_chunks m_pending;
   std::string m_generator_name;
   std::string m_source_name;
+  unsigned int m_compression_threads;
+  blob_compression m_compression;
+  // declared after the output streams, so that the compression threads are
+  // stopped before the stream is destroyed.
+  boost::scoped_ptr<blob_pipeline> m_blobs;
 
-  // (RELATIONS ONLY) keep track of the estimated pgroup size. normally the
-  // pgroup is flushed after a fixed number of elements, but sometimes if the
-  // elements are really big then this overflows the maximum pblock size. by
-  // tracking the estimated size, the pgroup can be flushed early, avoiding
-  // overflow.
-  int64_t m_est_pgroup_sz;
+private:
+  // the node locations are filled in as the nodes are written, and the
+  // ways can't be encoded until they all have been. nodes come before
+  // ways and relations, so when this writer gets to those, it's done
+  // with its nodes.
+  void update_locations(const std::vector<node> &nodes) {
+    if (!m_locations) { return; }
+    BOOST_FOREACH(const node &n, nodes) {
+      if (n.visible) {
+        m_locations->insert(n.id, n.latitude, n.longitude);
+      }
+    }
+  }
 
-  int64_t m_last_dense_id;
-  int64_t m_last_dense_lat;
-  int64_t m_last_dense_lon;
-  int64_t m_last_dense_timestamp;
-  int64_t m_last_dense_changeset;
-  int32_t m_last_dense_uid;
-  int32_t m_last_dense_user_sid;
+  void update_locations(const std::vector<way> &) {
+    if (!m_locations) { return; }
+    complete_locations();
+    m_locations->wait();
+  }
+
+  void update_locations(const std::vector<relation> &) {
+    complete_locations();
+  }
+
+  void complete_locations() {
+    if (m_owns_locations && m_locations) {
+      m_locations->complete();
+    }
+  }
+
+  // submit kept back elements as a block of their own, which takes the
+  // copies with it.
+  template <typename T>
+  void submit_pending(pending_chunk<T> &pending) {
+    if (pending.elements.empty()) { return; }
+    boost::shared_ptr<pending_chunk<T> > block = boost::make_shared<pending_chunk<T> >();
+    block->swap(pending);
+    pending.sizer.reset();
+    m_blobs->submit("OSMData", boost::bind(&encode_pending<T>, m_settings,
+                                           boost::shared_ptr<const pending_chunk<T> >(block), _1));
+  }
+
+  template <typename T>
+  void start_block(pending_chunk<T> &pending) {
+    pending.sizer.reset(new block_sizer(sizing_settings_of(m_settings)));
+  }
+
+  void submit_pending_except(const void *keep) {
+    if (keep != &m_pending.nodes) { submit_pending(m_pending.nodes); }
+    if (keep != &m_pending.ways) { submit_pending(m_pending.ways); }
+    if (keep != &m_pending.relations) { submit_pending(m_pending.relations); }
+  }
 
-private:
-  
   pimpl(const pimpl &);
   const pimpl &operator=(const pimpl &);
 };
 
+void check_pbf_compression(const boost::program_options::variables_map &options) {
+  compression_options(options);
+}
+
 pbf_writer::pbf_writer(const std::string &file_name, const boost::program_options::variables_map &options, 
-                       const user_map_t &users, const boost::posix_time::ptime &now, user_info_level uil, historical_versions hv, changeset_discussions cd)
-  : m_impl(new pimpl(file_name, now, uil, hv, users, options)) {
+                       const user_index &, const boost::posix_time::ptime &now, user_info_level uil, historical_versions hv, changeset_discussions)
+  : m_impl(new pimpl(std::vector<std::string>(1, file_name), now, variant_of(uil), hv, options)),
+    m_section_files(int(nwr_relation) + 1) {
+}
+
+pbf_writer::pbf_writer(const std::string &file_name, const std::string &anon_file_name,
+                       const boost::program_options::variables_map &options,
+                       const user_index &, const boost::posix_time::ptime &now, historical_versions hv, changeset_discussions)
+  : m_section_files(int(nwr_relation) + 1) {
+  std::vector<std::string> names;
+  names.push_back(file_name);
+  names.push_back(anon_file_name);
+  m_impl.reset(new pimpl(names, now, all_variants, hv, options));
+}
+
+pbf_writer::pbf_writer(const pbf_writer &parent, const std::vector<std::string> &section_files)
+  : m_impl(new pimpl(section_files, *parent.m_impl)) {
 }
 
 pbf_writer::~pbf_writer() {
 }
 
-void pbf_writer::changesets(const std::vector<changeset> &cs,
+void pbf_writer::changesets(const std::vector<changeset> &,
                             const std::vector<current_tag> &,
                             const std::vector<changeset_comment> &) {
-  std::map<int64_t, int64_t> &changeset_user_map = m_impl->m_changeset_user_map;
-  BOOST_FOREACH(const changeset &c, cs) {
-    changeset_user_map.insert(std::make_pair(c.id, c.uid));
-  }
+  // nothing to do - changesets aren't written to PBF, and the users of
+  // elements are resolved from their changesets in the join.
 }
 
 void pbf_writer::nodes(const std::vector<node> &ns,
                        const std::vector<old_tag> &ts) {
-  std::vector<old_tag>::const_iterator tag_itr = ts.begin();
-
-  BOOST_FOREACH(const node &n, ns) {
-    m_impl->add_node(n);
-
-    if (n.visible) {
-      while ((tag_itr != ts.end()) && 
-             ((tag_itr->element_id < n.id) ||
-              ((tag_itr->element_id == n.id) &&
-               (tag_itr->version <= n.version)))) {
-        if ((tag_itr->element_id == n.id) && (tag_itr->version == n.version)) {
-          m_impl->add_tag(*tag_itr, true);
-        }
-        ++tag_itr;
-      }
-    }
-    m_impl->add_node_finish();
-  }    
+  static const std::vector<int> no_inners;
+  m_impl->write_chunk(ns, no_inners, ts);
 }
 
 void pbf_writer::ways(const std::vector<way> &ws,
                       const std::vector<way_node> &wns,
                       const std::vector<old_tag> &ts) {
-  std::vector<old_tag>::const_iterator tag_itr = ts.begin();
-  std::vector<way_node>::const_iterator nd_itr = wns.begin();
-
-  BOOST_FOREACH(const way &w, ws) {
-    m_impl->add_way(w);
-
-    if (!w.visible) { continue; }
-
-    while ((nd_itr != wns.end()) && 
-           ((nd_itr->way_id < w.id) ||
-            ((nd_itr->way_id == w.id) &&
-             (nd_itr->version <= w.version)))) {
-      if ((nd_itr->way_id == w.id) && (nd_itr->version == w.version)) {
-        m_impl->add_way_node(*nd_itr);
-      }
-      ++nd_itr;
-    }
-
-    while ((tag_itr != ts.end()) && 
-           ((tag_itr->element_id < w.id) ||
-            ((tag_itr->element_id == w.id) &&
-             (tag_itr->version <= w.version)))) {
-      if ((tag_itr->element_id == w.id) && (tag_itr->version == w.version)) {
-        m_impl->add_tag(*tag_itr, false);
-      }
-      ++tag_itr;
-    }
-  }
+  m_impl->write_chunk(ws, wns, ts);
 }
 
 void pbf_writer::relations(const std::vector<relation> &rs,
                            const std::vector<relation_member> &rms,
                            const std::vector<old_tag> &ts) {
-  std::vector<old_tag>::const_iterator tag_itr = ts.begin();
-  std::vector<relation_member>::const_iterator rm_itr = rms.begin();
-
-  BOOST_FOREACH(const relation &r, rs) {
-    m_impl->add_relation(r);
-
-    if (!r.visible) { continue; }
-
-    while ((rm_itr != rms.end()) && 
-           ((rm_itr->relation_id < r.id) ||
-            ((rm_itr->relation_id == r.id) &&
-             (rm_itr->version <= r.version)))) {
-      if ((rm_itr->relation_id == r.id) && (rm_itr->version == r.version)) {
-        m_impl->add_relation_member(*rm_itr);
-      }
-      ++rm_itr;
-    }
+  m_impl->write_chunk(rs, rms, ts);
+}
 
-    while ((tag_itr != ts.end()) && 
-           ((tag_itr->element_id < r.id) ||
-            ((tag_itr->element_id == r.id) &&
-             (tag_itr->version <= r.version)))) {
-      if ((tag_itr->element_id == r.id) && (tag_itr->version == r.version)) {
-        m_impl->add_tag(*tag_itr, false);
-      }
-      ++tag_itr;
-    }
+boost::shared_ptr<output_writer> pbf_writer::section(nwr_enum type) {
+  std::vector<std::string> &file_names = m_section_files[type];
+  file_names.clear();
+  BOOST_FOREACH(const std::string &out_name, m_impl->m_out_names) {
+    file_names.push_back(section_file_name(out_name, type));
   }
+  boost::shared_ptr<pbf_writer> section(new pbf_writer(*this, file_names));
+  // the nodes section writes the nodes, so fills in their locations.
+  if (type == nwr_node) {
+    section->m_impl->m_owns_locations = m_impl->m_owns_locations;
+    m_impl->m_owns_locations = false;
+  }
+  return section;
 }
 
 void pbf_writer::finish() {
-  m_impl->finish();
+  // the section files for each output, in order.
+  std::vector<std::vector<std::string> > section_files(m_impl->m_out_names.size());
+  BOOST_FOREACH(const std::vector<std::string> &file_names, m_section_files) {
+    for (size_t i = 0; i < file_names.size(); ++i) {
+      section_files[i].push_back(file_names[i]);
+    }
+  }
+  m_impl->finish(section_files);
 }
@@ -1,5 +1,8 @@
 #include "copy_elements.hpp"
+#include "changeset_users.hpp"
 #include "dump_archive.hpp"
+#include "version_set.hpp"
+#include "current_versions.hpp"
 #include "output_writer.hpp"
 #include "xml_writer.hpp"
 #include "pbf_writer.hpp"
@@ -11,6 +14,8 @@
 #include <boost/shared_ptr.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/make_shared.hpp>
+#include <boost/format.hpp>
+#include <boost/filesystem.hpp>
 
 #include <boost/foreach.hpp>
 #include <string>
@@ -48,6 +53,10 @@ static void get_options(int argc, char **argv, po::variables_map &vm) {
     ("changeset-discussions-no-userinfo", po::value<std::string>(),
      "changeset discussions XML output file (without user data)")
     ("dense-nodes,d", po::value<bool>()->default_value("true"), "use dense nodes for PBF output")
+    ("parallel-sections", po::value<bool>()->default_value(true),
+     "write the nodes, ways and relations sections of each output concurrently "
+     "to separate files, which are then joined together. uses more memory and "
+     "temporary disk space than writing them one after another.")
     ("dump-file,f", po::value<std::string>(), "PostgreSQL table dump to read")
     ("generator", po::value<std::string>()->default_value(PACKAGE_STRING),
      "Override the generator string used by the program. Used by the tests to "
@@ -55,8 +64,42 @@ static void get_options(int argc, char **argv, po::variables_map &vm) {
     ("resume", "If this argument is present, then planet-dump-ng will attempt "
      "to resume processing from partial data. If not present, then it will "
      "start from scratch.")
+    ("previous-run", po::value<std::string>(),
+     "Directory of a previous run of planet-dump-ng on an older dump. The history "
+     "tables of nodes, ways, relations and their tags, way nodes and relation "
+     "members are then extracted incrementally, sorting only the rows which are "
+     "newer than those in the previous run's databases and merging them in. Must "
+     "not be the current directory.")
     ("max-concurrency", po::value<unsigned int>()->default_value(16),
       "Maximum number of disk writing threads to run for *each* table.")
+    ("join-threads", po::value<unsigned int>()->default_value(4),
+      "Maximum number of threads joining elements with their tags, way nodes "
+      "and relation members for *each* element type, each taking a range of IDs.")
+    ("max-queued-blocks", po::value<unsigned int>()->default_value(4),
+      "Maximum number of blocks of elements which the slowest writer can fall "
+      "behind the others before reading pauses, for *each* element type.")
+    ("read-ahead", po::value<bool>()->default_value(true),
+      "Decompress and decode each of the databases being joined on a thread of "
+      "its own, ahead of the join.")
+    ("pbf-compression", po::value<std::string>()->default_value("zlib"),
+      "Compression for the blobs of PBF output files: zlib, zstd, lz4 or none. "
+      "zstd and lz4 are faster, but not all readers support them.")
+    ("pbf-compression-level", po::value<int>(),
+      "Level of PBF compression. Defaults to 9 for zlib, zstd's own default, "
+      "and 0 for lz4, which is its fast mode.")
+    ("pbf-compression-threads", po::value<unsigned int>()->default_value(4),
+      "Number of threads encoding and compressing blocks for *each* PBF output "
+      "file, or section of one, which are written out in order. With zero, "
+      "blocks are encoded and compressed on the thread writing the file.")
+    ("pbf-locations-on-ways", po::value<bool>()->default_value(false),
+      "Add the location of each node to the ways which use it in the planet PBF "
+      "files (without history), as the LocationsOnWays feature. The locations are "
+      "kept in a temporary file, 8 bytes for each node ID, and the ways can't be "
+      "written until all the nodes have been.")
+    ("interleave", po::value<bool>()->default_value(false),
+      "Merge each element type's database with those of its tags, way nodes or "
+      "relation members into a single database, so that the elements are read "
+      "already joined. Takes extra disk space, but is kept between --resume runs.")
     ("meta-file,M", po::value<std::string>(&meta_file), "data metainfo configuration file")
     ;
     
@@ -98,6 +141,18 @@ static void get_options(int argc, char **argv, po::variables_map &vm) {
     exit(1);
   }
   
+  if (vm.count("previous-run")) {
+    const std::string previous_dir = vm["previous-run"].as<std::string>();
+    if (!boost::filesystem::is_directory(previous_dir)) {
+      BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Previous run directory '%1%' does not exist.") % previous_dir).str()));
+    }
+    if (boost::filesystem::equivalent(previous_dir, boost::filesystem::current_path())) {
+      BOOST_THROW_EXCEPTION(std::runtime_error("The previous run (--previous-run) must be in a different directory to this one."));
+    }
+  }
+
+  check_pbf_compression(vm);
+
   if (vm.count("meta-file")) {
     std::ifstream ifs(meta_file.c_str());
     if (!ifs)
@@ -113,32 +168,115 @@ static void get_options(int argc, char **argv, po::variables_map &vm) {
   }
 }
 
+/**
+ * which of the tables are needed for the outputs requested in the options.
+ * the changesets, their tags and comments are always needed, as all the
+ * outputs read the changesets, and the comments contribute to the time
+ * which the outputs are stamped with.
+ */
+struct table_plan {
+  // the nodes, ways and relations, with their tags, way nodes and
+  // relation members.
+  bool elements;
+
+  // the users, for outputs which include user info. discussions without
+  // user info still need them, as only the comments of users whose data is
+  // public are written.
+  bool users;
+
+  // whether any output of nodes, ways and relations includes user info,
+  // so that their users need to be resolved from their changesets.
+  bool element_users;
+
+  // whether any output includes historical versions of elements. if not,
+  // only the current versions are kept in the element databases.
+  bool history;
+};
+
+static table_plan plan_tables(const po::variables_map &vm) {
+  table_plan plan;
+
+  plan.elements = (vm.count("xml") + vm.count("history-xml") +
+                   vm.count("pbf") + vm.count("history-pbf") +
+                   vm.count("xml-no-userinfo") + vm.count("history-xml-no-userinfo") +
+                   vm.count("pbf-no-userinfo") + vm.count("history-pbf-no-userinfo")) > 0;
+
+  plan.users = (vm.count("xml") + vm.count("history-xml") +
+                vm.count("pbf") + vm.count("history-pbf") +
+                vm.count("changesets") + vm.count("changeset-discussions") +
+                vm.count("changeset-discussions-no-userinfo")) > 0;
+
+  plan.element_users = (vm.count("xml") + vm.count("history-xml") +
+                        vm.count("pbf") + vm.count("history-pbf")) > 0;
+
+  plan.history = (vm.count("history-xml") + vm.count("history-xml-no-userinfo") +
+                  vm.count("history-pbf") + vm.count("history-pbf-no-userinfo")) > 0;
+
+  return plan;
+}
+
 /**
  * read the dump file in parallel to get all of the elements into on-disk
  * databases. this is primarily so that the data is sorted, which is not
  * guaranteed in the PostgreSQL dump file. returns the maximum time seen
  * in a timestamp of any element in the dump file.
+ *
+ * if previous_dir isn't empty, the history tables are extracted on top of
+ * the databases of the previous run in that directory. tables which aren't
+ * in the plan are not extracted at all, and if the plan has no history the
+ * element tables keep only the current versions.
  */
-bt::ptime setup_databases(const std::string &dump_file, bool resume, unsigned int max_concurrency) {
+bt::ptime setup_databases(const std::string &dump_file, bool resume, unsigned int max_concurrency,
+                          const std::string &previous_dir, const table_plan &plan) {
   std::list<boost::shared_ptr<base_thread> > threads;
   
+  // redacted versions of elements found while reading each element table,
+  // so that their tags and inners can be dropped too.
+  boost::shared_ptr<version_set> node_redactions = boost::make_shared<version_set>();
+  boost::shared_ptr<version_set> way_redactions = boost::make_shared<version_set>();
+  boost::shared_ptr<version_set> relation_redactions = boost::make_shared<version_set>();
+
+  // versions which are new since the previous run, if there is one.
+  boost::shared_ptr<version_set> new_nodes, new_ways, new_relations;
+  if (!previous_dir.empty()) {
+    new_nodes = boost::make_shared<version_set>();
+    new_ways = boost::make_shared<version_set>();
+    new_relations = boost::make_shared<version_set>();
+  }
+
+  // the element databases which the current versions are taken from, if
+  // no history is wanted.
+  boost::shared_ptr<current_versions> current_nodes, current_ways, current_relations;
+  if (!plan.history) {
+    current_nodes = boost::make_shared<current_versions>("nodes");
+    current_ways = boost::make_shared<current_versions>("ways");
+    current_relations = boost::make_shared<current_versions>("relations");
+  }
+
 #define THREAD_RUN(type,table) threads.push_back(boost::make_shared<run_thread<type> >(table, dump_file, resume, max_concurrency))
+#define THREAD_RUN_REDACTED(type,table,redactions,new_versions,current) threads.push_back(boost::make_shared<run_thread<type> >(table, dump_file, resume, max_concurrency, redactions, previous_dir, new_versions, current))
 
   THREAD_RUN(changeset, "changesets");
-  THREAD_RUN(node, "nodes");
-  THREAD_RUN(way, "ways");
-  THREAD_RUN(relation, "relations");
-  
   THREAD_RUN(current_tag, "changeset_tags");
-  THREAD_RUN(old_tag, "node_tags");
-  THREAD_RUN(old_tag, "way_tags");
-  THREAD_RUN(old_tag, "relation_tags");
-  THREAD_RUN(way_node, "way_nodes");
-  THREAD_RUN(relation_member, "relation_members");
-  
-  THREAD_RUN(user, "users");
   THREAD_RUN(changeset_comment, "changeset_comments");
 
+  if (plan.elements) {
+    THREAD_RUN_REDACTED(node, "nodes", node_redactions, new_nodes, current_nodes);
+    THREAD_RUN_REDACTED(way, "ways", way_redactions, new_ways, current_ways);
+    THREAD_RUN_REDACTED(relation, "relations", relation_redactions, new_relations, current_relations);
+
+    THREAD_RUN_REDACTED(old_tag, "node_tags", node_redactions, new_nodes, current_nodes);
+    THREAD_RUN_REDACTED(old_tag, "way_tags", way_redactions, new_ways, current_ways);
+    THREAD_RUN_REDACTED(old_tag, "relation_tags", relation_redactions, new_relations, current_relations);
+    THREAD_RUN_REDACTED(way_node, "way_nodes", way_redactions, new_ways, current_ways);
+    THREAD_RUN_REDACTED(relation_member, "relation_members", relation_redactions, new_relations, current_relations);
+  }
+
+  if (plan.users) {
+    THREAD_RUN(user, "users");
+  }
+
+#undef THREAD_RUN_REDACTED
 #undef THREAD_RUN
   
   bt::ptime max_time(bt::neg_infin);
@@ -151,6 +289,37 @@ bt::ptime setup_databases(const std::string &dump_file, bool resume, unsigned in
   return max_time;
 }
 
+/**
+ * add the writers for an output option and its "-no-userinfo" variant, if
+ * they were asked for. when both are, a single writer writes the pair of
+ * files, so that everything but the user info is only serialised once.
+ */
+template <typename W>
+static void add_writers(std::vector<boost::shared_ptr<output_writer> > &writers,
+                        const po::variables_map &options, const std::string &option_name,
+                        const user_index &users, const bt::ptime &max_time,
+                        historical_versions hv, changeset_discussions cd) {
+  const std::string anon_option_name = option_name + "-no-userinfo";
+  const bool full = options.count(option_name) > 0;
+  const bool anon = options.count(anon_option_name) > 0;
+
+  if (full && anon) {
+    writers.push_back(boost::shared_ptr<output_writer>(new W(
+      options[option_name].as<std::string>(), options[anon_option_name].as<std::string>(),
+      options, users, max_time, hv, cd)));
+
+  } else if (full) {
+    writers.push_back(boost::shared_ptr<output_writer>(new W(
+      options[option_name].as<std::string>(), options,
+      users, max_time, user_info_level::FULL, hv, cd)));
+
+  } else if (anon) {
+    writers.push_back(boost::shared_ptr<output_writer>(new W(
+      options[anon_option_name].as<std::string>(), options,
+      users, max_time, user_info_level::ANON, hv, cd)));
+  }
+}
+
 int main(int argc, char *argv[]) {
   try {
     po::variables_map options;
@@ -166,87 +335,71 @@ int main(int argc, char *argv[]) {
     const bool resume = options.count("resume") > 0;
     unsigned int max_concurrency = options["max-concurrency"].as<unsigned int>();
     const std::string dump_file(options["dump-file"].as<std::string>());
-    const bt::ptime max_time = setup_databases(dump_file, resume, max_concurrency);
+    const std::string previous_dir = options.count("previous-run") ? options["previous-run"].as<std::string>() : std::string();
+    const table_plan plan = plan_tables(options);
+    const bt::ptime max_time = setup_databases(dump_file, resume, max_concurrency, previous_dir, plan);
 
-    // users aren't dumped directly to the files. we only use them to build up a map
-    // of uid -> name where a missing uid indicates that the user doesn't have public
-    // data.
-    std::map<int64_t, std::string> display_name_map;
-    extract_users(display_name_map);
+    if (options["interleave"].as<bool>()) {
+      std::cerr << "Interleaving databases..." << std::endl;
+      interleave_tables<changeset>(resume);
+      if (plan.elements) {
+        interleave_tables<node>(resume);
+        interleave_tables<way>(resume);
+        interleave_tables<relation>(resume);
+      }
+    }
+
+    // users aren't dumped directly to the files. we only use them to build up an
+    // index of uid -> name where a missing uid indicates that the user doesn't have
+    // public data.
+    boost::shared_ptr<const user_index> display_names;
+    if (plan.users) {
+      display_names = extract_users();
+    } else {
+      display_names = boost::make_shared<user_index>();
+    }
 
     // build up a list of writers. these will be written to in parallel, which is
     // mildly wasteful if there's just one output type, but works great when all of
     // the output types are being used.
     std::vector<boost::shared_ptr<output_writer> > writers;
-    if (options.count("history-xml")) {
-      std::string output_file = options["history-xml"].as<std::string>();
-      writers.push_back(boost::shared_ptr<output_writer>(new xml_writer(output_file, options, 
-        display_name_map, max_time, user_info_level::FULL, historical_versions::FULL, changeset_discussions::NONE)));
-    }
-    if (options.count("history-xml-no-userinfo")) {
-      std::string output_file = options["history-xml-no-userinfo"].as<std::string>();
-      writers.push_back(boost::shared_ptr<output_writer>(new xml_writer(output_file, options, 
-        display_name_map, max_time, user_info_level::ANON, historical_versions::FULL, changeset_discussions::NONE)));
-    }
-    if (options.count("history-pbf")) {
-      std::string output_file = options["history-pbf"].as<std::string>();
-      writers.push_back(boost::shared_ptr<output_writer>(new pbf_writer(output_file, options, 
-        display_name_map, max_time, user_info_level::FULL, historical_versions::FULL, changeset_discussions::NONE)));
-    }
-    if (options.count("history-pbf-no-userinfo")) {
-      std::string output_file = options["history-pbf-no-userinfo"].as<std::string>();
-      writers.push_back(boost::shared_ptr<output_writer>(new pbf_writer(output_file, options, 
-        display_name_map, max_time, user_info_level::ANON, historical_versions::FULL, changeset_discussions::NONE)));
-    }
-    if (options.count("xml")) {
-      std::string output_file = options["xml"].as<std::string>();
-      writers.push_back(boost::shared_ptr<output_writer>(new history_filter<xml_writer>(output_file, options, 
-        display_name_map, max_time, user_info_level::FULL, historical_versions::NONE, changeset_discussions::NONE)));
-    }
-    if (options.count("xml-no-userinfo")) {
-      std::string output_file = options["xml-no-userinfo"].as<std::string>();
-      writers.push_back(boost::shared_ptr<output_writer>(new history_filter<xml_writer>(output_file, options, 
-        display_name_map, max_time, user_info_level::ANON, historical_versions::NONE, changeset_discussions::NONE)));
-    }
-    if (options.count("pbf")) {
-      std::string output_file = options["pbf"].as<std::string>();
-      writers.push_back(boost::shared_ptr<output_writer>(new history_filter<pbf_writer>(output_file, options, 
-        display_name_map, max_time, user_info_level::FULL, historical_versions::NONE, changeset_discussions::NONE)));
-    }
-    if (options.count("pbf-no-userinfo")) {
-      std::string output_file = options["pbf-no-userinfo"].as<std::string>();
-      writers.push_back(boost::shared_ptr<output_writer>(new history_filter<pbf_writer>(output_file, options, 
-        display_name_map, max_time, user_info_level::ANON, historical_versions::NONE, changeset_discussions::NONE)));
-    }
-    if (options.count("changesets")) {
-      std::string output_file = options["changesets"].as<std::string>();
-      writers.push_back(boost::shared_ptr<output_writer>(new changeset_filter<xml_writer>(output_file, options, 
-        display_name_map, max_time, user_info_level::FULL, historical_versions::NONE, changeset_discussions::NONE)));
-    }
-    if (options.count("changesets-no-userinfo")) {
-      std::string output_file = options["changesets-no-userinfo"].as<std::string>();
-      writers.push_back(boost::shared_ptr<output_writer>(new changeset_filter<xml_writer>(output_file, options, 
-        display_name_map, max_time, user_info_level::ANON, historical_versions::NONE, changeset_discussions::NONE)));
-    }
-    if (options.count("changeset-discussions")) {
-      std::string output_file = options["changeset-discussions"].as<std::string>();
-      writers.push_back(boost::shared_ptr<output_writer>(new changeset_filter<xml_writer>(output_file, options, 
-        display_name_map, max_time, user_info_level::FULL, historical_versions::NONE, changeset_discussions::FULL)));
-    }
-    if (options.count("changeset-discussions-no-userinfo")) {
-      std::string output_file = options["changeset-discussions-no-userinfo"].as<std::string>();
-      writers.push_back(boost::shared_ptr<output_writer>(new changeset_filter<xml_writer>(output_file, options, 
-        display_name_map, max_time, user_info_level::ANON, historical_versions::NONE, changeset_discussions::FULL)));
+    add_writers<xml_writer>(writers, options, "history-xml", *display_names, max_time,
+                            historical_versions::FULL, changeset_discussions::NONE);
+    add_writers<pbf_writer>(writers, options, "history-pbf", *display_names, max_time,
+                            historical_versions::FULL, changeset_discussions::NONE);
+    add_writers<history_filter<xml_writer> >(writers, options, "xml", *display_names, max_time,
+                                             historical_versions::NONE, changeset_discussions::NONE);
+    add_writers<history_filter<pbf_writer> >(writers, options, "pbf", *display_names, max_time,
+                                             historical_versions::NONE, changeset_discussions::NONE);
+    add_writers<changeset_filter<xml_writer> >(writers, options, "changesets", *display_names, max_time,
+                                               historical_versions::NONE, changeset_discussions::NONE);
+    add_writers<changeset_filter<xml_writer> >(writers, options, "changeset-discussions", *display_names, max_time,
+                                               historical_versions::NONE, changeset_discussions::FULL);
+
+    // the users of elements are resolved from their changesets once, in
+    // the join, for all the writers which want user info.
+    boost::shared_ptr<changeset_users> users;
+    if (plan.element_users) {
+      users = boost::make_shared<changeset_users>(boost::cref(*display_names));
     }
 
     std::cerr << "Writing changesets..." << std::endl;
-    run_threads<changeset>(writers);
-    std::cerr << "Writing nodes..." << std::endl;
-    run_threads<node>(writers);
-    std::cerr << "Writing ways..." << std::endl;
-    run_threads<way>(writers);
-    std::cerr << "Writing relations..." << std::endl;
-    run_threads<relation>(writers);
+    run_threads<changeset>(writers, options, users);
+    // the elements are only extracted, and written, if an output needs them.
+    if (plan.elements) {
+      if (options["parallel-sections"].as<bool>()) {
+        std::cerr << "Writing nodes, ways and relations..." << std::endl;
+        run_sections(writers, options, users);
+
+      } else {
+        std::cerr << "Writing nodes..." << std::endl;
+        run_threads<node>(writers, options, users);
+        std::cerr << "Writing ways..." << std::endl;
+        run_threads<way>(writers, options, users);
+        std::cerr << "Writing relations..." << std::endl;
+        run_threads<relation>(writers, options, users);
+      }
+    }
 
     // tell writers to clean up - write finals, close files, that sort of thing
     BOOST_FOREACH(boost::shared_ptr<output_writer> writer, writers) {
@@ -40,15 +40,19 @@ const std::vector<std::string> &changeset_comment::column_names() { return chang
 const std::string changeset::table_name() { return "changesets"; }
 const std::string changeset::tag_table_name() { return "changeset_tags"; }
 const std::string changeset::inner_table_name() { return "changeset_comments"; }
+const std::string changeset::interleaved_table_name() { return "changesets_interleaved"; }
 
 const std::string node::table_name() { return "nodes"; }
 const std::string node::tag_table_name() { return "node_tags"; }
 const std::string node::inner_table_name() { return ""; }
+const std::string node::interleaved_table_name() { return "nodes_interleaved"; }
 
 const std::string way::table_name() { return "ways"; }
 const std::string way::tag_table_name() { return "way_tags"; }
 const std::string way::inner_table_name() { return "way_nodes"; }
+const std::string way::interleaved_table_name() { return "ways_interleaved"; }
 
 const std::string relation::table_name() { return "relations"; }
 const std::string relation::tag_table_name() { return "relation_tags"; }
 const std::string relation::inner_table_name() { return "relation_members"; }
+const std::string relation::interleaved_table_name() { return "relations_interleaved"; }
@@ -0,0 +1,53 @@
+#include "user_index.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <boost/format.hpp>
+#include <boost/throw_exception.hpp>
+
+namespace {
+
+bool id_less(const user_info &u, int64_t id) {
+  return u.id < id;
+}
+
+} // anonymous namespace
+
+user_index::user_index()
+  : m_users(), m_arena() {
+}
+
+void user_index::push_back(int64_t id, const std::string &display_name) {
+  if (!m_users.empty() && (m_users.back().id >= id)) {
+    BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("User ID %1% added to the user index after %2%.") % id % m_users.back().id).str()));
+  }
+
+  // the name's pointer isn't known until the arena has stopped growing, so
+  // it's filled in by finish().
+  user_info u;
+  u.id = id;
+  u.display_name = NULL;
+  u.display_name_length = display_name.size();
+  m_users.push_back(u);
+
+  m_arena.append(display_name);
+  m_arena.push_back('\0');
+}
+
+void user_index::finish() {
+  std::vector<user_info>(m_users).swap(m_users);
+
+  const char *ptr = m_arena.data();
+  for (std::vector<user_info>::iterator itr = m_users.begin(); itr != m_users.end(); ++itr) {
+    itr->display_name = ptr;
+    ptr += itr->display_name_length + 1;
+  }
+}
+
+const user_info *user_index::find(int64_t id) const {
+  std::vector<user_info>::const_iterator itr = std::lower_bound(m_users.begin(), m_users.end(), id, &id_less);
+  if ((itr == m_users.end()) || (itr->id != id)) {
+    return NULL;
+  }
+  return &(*itr);
+}
@@ -0,0 +1,88 @@
+#include "version_set.hpp"
+#include "config.h"
+
+#include <endian.h>
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+#include <boost/format.hpp>
+#include <boost/throw_exception.hpp>
+
+version_set::version_set()
+  : m_finished(false) {
+}
+
+void version_set::insert(int64_t id, int64_t version) {
+  boost::lock_guard<boost::mutex> lock(m_mutex);
+  m_versions.push_back(std::make_pair(id, version));
+}
+
+void version_set::finish() {
+  boost::lock_guard<boost::mutex> lock(m_mutex);
+  if (!m_finished) {
+    std::sort(m_versions.begin(), m_versions.end());
+    m_versions.erase(std::unique(m_versions.begin(), m_versions.end()), m_versions.end());
+    m_finished = true;
+    m_cond.notify_all();
+  }
+}
+
+void version_set::wait() const {
+  boost::unique_lock<boost::mutex> lock(m_mutex);
+  while (!m_finished) {
+    m_cond.wait(lock);
+  }
+}
+
+bool version_set::empty() const {
+  boost::lock_guard<boost::mutex> lock(m_mutex);
+  return m_versions.empty();
+}
+
+namespace {
+
+// the id and version at the start of a key, which are stored big-endian.
+std::pair<int64_t, int64_t> key_version(const std::string &key) {
+  uint64_t id = 0, version = 0;
+  std::copy(key.data(), key.data() + sizeof(uint64_t), (char *)&id);
+  std::copy(key.data() + sizeof(uint64_t), key.data() + 2 * sizeof(uint64_t), (char *)&version);
+  return std::make_pair(int64_t(be64toh(id)), int64_t(be64toh(version)));
+}
+
+} // anonymous namespace
+
+void version_set::insert_key(const std::string &key) {
+  if (key.size() < 2 * sizeof(uint64_t)) {
+    BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Key of %1% bytes is too short to contain a version.") % key.size()).str()));
+  }
+  boost::lock_guard<boost::mutex> lock(m_mutex);
+  m_versions.push_back(key_version(key));
+}
+
+bool version_set::contains_key(const std::string &key) const {
+  if (key.size() < 2 * sizeof(uint64_t)) { return false; }
+
+  return std::binary_search(m_versions.begin(), m_versions.end(), key_version(key));
+}
+
+void version_set::save(const std::string &file_name) const {
+  boost::lock_guard<boost::mutex> lock(m_mutex);
+  std::ofstream out(file_name.c_str(), std::ios::binary);
+  for (size_t i = 0; i < m_versions.size(); ++i) {
+    out.write((const char *)&m_versions[i].first, sizeof(int64_t));
+    out.write((const char *)&m_versions[i].second, sizeof(int64_t));
+  }
+  if (!out.good()) {
+    BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unable to write versions to '%1%'.") % file_name).str()));
+  }
+}
+
+void version_set::load(const std::string &file_name) {
+  boost::lock_guard<boost::mutex> lock(m_mutex);
+  std::ifstream in(file_name.c_str(), std::ios::binary);
+  std::pair<int64_t, int64_t> version;
+  while (in.read((char *)&version.first, sizeof(int64_t)) &&
+         in.read((char *)&version.second, sizeof(int64_t))) {
+    m_versions.push_back(version);
+  }
+}
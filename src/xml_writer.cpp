@@ -6,7 +6,9 @@
 #include <libxml/xmlwriter.h>
 
 #include <stdexcept>
+#include <fstream>
 #include <boost/foreach.hpp>
+#include <boost/make_shared.hpp>
 #include <boost/format.hpp>
 #include <boost/algorithm/string.hpp>
 #include <boost/exception/all.hpp>
@@ -55,17 +57,18 @@ std::string replace_xml_bad_chars(const std::string &s) {
   return output;
 }
 
-std::string popen_command(const std::string &file_name, const boost::program_options::variables_map &options) {
-  std::string compress_command;
+std::string compress_command(const std::string &file_name, const boost::program_options::variables_map &options) {
   try {
-    compress_command = options["compress-command"].as<std::string>();
+    return options["compress-command"].as<std::string>();
   } catch (...) {
     boost::throw_exception(
       boost::enable_error_info(
         std::runtime_error((boost::format("Unable to get options for \"%1%\".") % file_name).str()))
       << boost::errinfo_nested_exception(boost::current_exception()));
   }
+}
 
+std::string popen_command(const std::string &file_name, const std::string &compress_command, bool append) {
   // need to shell escape the file name.
   // NOTE: this seems to be incredibly ill-defined, and varies depending on the
   // system shell. a better way would be to open the file directly and dup
@@ -74,7 +77,7 @@ std::string popen_command(const std::string &file_name, const boost::program_opt
   boost::find_format_all(escaped_file_name, boost::token_finder(boost::is_any_of("\\\"")), shell_escape_char());
 
   std::ostringstream command;
-  command << compress_command << " > \"" << escaped_file_name << "\"";
+  command << compress_command << (append ? " >> \"" : " > \"") << escaped_file_name << "\"";
   return command.str();
 }
 
@@ -125,10 +128,29 @@ std::string fmt_iso_time(const pt::ptime &t) {
 } // anonymous namespace
 
 struct xml_writer::pimpl {
-  pimpl(const std::string &file_name, const boost::program_options::variables_map &options,
-        const pt::ptime &now, bool has_history);
+  // if anon_file_name isn't empty, then everything is also written to a
+  // second output, apart from the user info.
+  pimpl(const std::string &file_name, const std::string &anon_file_name,
+        const std::string &compress_command,
+        const pt::ptime &now, bool has_history, bool muted);
   ~pimpl();
 
+  // while muted, anything written is discarded rather than sent to the
+  // output. this is used by section writers to skip the document header
+  // and footer, which only the parent writer outputs.
+  void mute();
+  void unmute();
+
+  // anything written between these goes only to the first output, and is
+  // left out of the one without user info.
+  void begin_user_info();
+  void end_user_info();
+
+  // close the current output streams, append the section files to the
+  // output files and re-open the output streams to write what remains.
+  void append_sections(const std::vector<std::string> &section_files,
+                       const std::vector<std::string> &anon_section_files);
+
   void begin(const char *name);
   void attribute(const char *name, bool b);
   void attribute(const char *name, int32_t i);
@@ -146,24 +168,50 @@ struct xml_writer::pimpl {
 
   void start_discussion();
   void end_discussion();
-  void add_comment(const changeset_comment &c, const std::string &display_name, user_info_level uil);
+  void add_comment(const changeset_comment &c, const char *display_name, user_info_level uil);
 
   // flush & close output stream
   void finish();
 
-  std::string m_command;
-  FILE *m_out;
+  std::string m_file_name, m_anon_file_name, m_compress_command;
+  FILE *m_out, *m_anon_out;
   xmlTextWriterPtr m_writer;
   pt::ptime m_now;
   bool m_has_history;
+  bool m_muted, m_in_user_info;
+
+private:
+  void flush();
 };
 
+namespace {
+
+FILE *open_output(const std::string &file_name, const std::string &compress_command, bool append) {
+  FILE *out = popen(popen_command(file_name, compress_command, append).c_str(), "w");
+  if (out == NULL) {
+    BOOST_THROW_EXCEPTION(std::runtime_error("Unable to popen compression command for output."));
+  }
+  return out;
+}
+
+void write_output(FILE *out, const char *buffer, size_t len) {
+  const size_t status = fwrite(buffer, 1, len, out);
+  if (status < len) {
+    BOOST_THROW_EXCEPTION(std::runtime_error("Failed to write to output stream."));
+  }
+}
+
+} // anonymous namespace
+
 static int wrap_write(void *context, const char *buffer, int len) {
   xml_writer::pimpl *impl = static_cast<xml_writer::pimpl *>(context);
 
   if (impl == NULL) {
     BOOST_THROW_EXCEPTION(std::runtime_error("State object NULL in wrap_write."));
   }
+  if (impl->m_muted) {
+    return len;
+  }
   if (impl->m_out == NULL) {
     BOOST_THROW_EXCEPTION(std::runtime_error("Output pipe NULL in wrap_write."));
   }
@@ -173,9 +221,9 @@ static int wrap_write(void *context, const char *buffer, int len) {
   }
   const size_t slen = len;
 
-  const size_t status = fwrite(buffer, 1, slen, impl->m_out);
-  if (status < slen) {
-    BOOST_THROW_EXCEPTION(std::runtime_error("Failed to write to output stream."));
+  write_output(impl->m_out, buffer, slen);
+  if ((impl->m_anon_out != NULL) && !impl->m_in_user_info) {
+    write_output(impl->m_anon_out, buffer, slen);
   }
   return len;
 }
@@ -191,21 +239,27 @@ static int wrap_close(void *context) {
   }
 
   int status = pclose(impl->m_out);
+  impl->m_out = NULL;
+  if ((status != -1) && (impl->m_anon_out != NULL)) {
+    status = pclose(impl->m_anon_out);
+    impl->m_anon_out = NULL;
+  }
   if (status == -1) {
     BOOST_THROW_EXCEPTION(std::runtime_error("Output pipe could not be closed in wrap_close."));
   }
-  impl->m_out = NULL;
 
   return 0;
 }
 
-xml_writer::pimpl::pimpl(const std::string &file_name, const boost::program_options::variables_map &options,
-                         const pt::ptime &now, bool has_history) 
-  : m_command(popen_command(file_name, options)), m_out(popen(m_command.c_str(), "w")), 
-    m_writer(NULL), m_now(now), m_has_history(has_history) {
-  
-  if (m_out == NULL) {
-    BOOST_THROW_EXCEPTION(std::runtime_error("Unable to popen compression command for output."));
+xml_writer::pimpl::pimpl(const std::string &file_name, const std::string &anon_file_name,
+                         const std::string &compress_command,
+                         const pt::ptime &now, bool has_history, bool muted)
+  : m_file_name(file_name), m_anon_file_name(anon_file_name), m_compress_command(compress_command),
+    m_out(open_output(file_name, compress_command, false)), m_anon_out(NULL),
+    m_writer(NULL), m_now(now), m_has_history(has_history), m_muted(muted), m_in_user_info(false) {
+
+  if (!anon_file_name.empty()) {
+    m_anon_out = open_output(anon_file_name, compress_command, false);
   }
 
   xmlOutputBufferPtr output_buffer =
@@ -240,6 +294,79 @@ void xml_writer::pimpl::finish() {
     // lying around.
     pclose(m_out);
   }
+  if (m_anon_out != NULL) {
+    pclose(m_anon_out);
+  }
+}
+
+void xml_writer::pimpl::flush() {
+  if (xmlTextWriterFlush(m_writer) < 0) {
+    BOOST_THROW_EXCEPTION(std::runtime_error("Unable to flush XML writer."));
+  }
+}
+
+void xml_writer::pimpl::mute() {
+  flush();
+  m_muted = true;
+}
+
+void xml_writer::pimpl::unmute() {
+  flush();
+  m_muted = false;
+}
+
+void xml_writer::pimpl::begin_user_info() {
+  // with only one output, there's nothing to keep apart.
+  if (m_anon_out != NULL) {
+    flush();
+    m_in_user_info = true;
+  }
+}
+
+void xml_writer::pimpl::end_user_info() {
+  if (m_anon_out != NULL) {
+    flush();
+    m_in_user_info = false;
+  }
+}
+
+namespace {
+
+// each section is a complete compressed stream, and so is the output so
+// far, so they can just be concatenated.
+FILE *append_sections_to(FILE *out, const std::string &file_name, const std::string &compress_command,
+                         const std::vector<std::string> &section_files) {
+  if (pclose(out) == -1) {
+    BOOST_THROW_EXCEPTION(std::runtime_error("Output pipe could not be closed before appending sections."));
+  }
+
+  {
+    std::ofstream file(file_name.c_str(), std::ios::binary | std::ios::app);
+    BOOST_FOREACH(const std::string &section_file, section_files) {
+      append_section_file(file, section_file);
+    }
+  }
+
+  return open_output(file_name, compress_command, true);
+}
+
+} // anonymous namespace
+
+void xml_writer::pimpl::append_sections(const std::vector<std::string> &section_files,
+                                        const std::vector<std::string> &anon_section_files) {
+  flush();
+
+  // the pipes are cleared before they're closed, so that they aren't
+  // closed again if appending the sections fails.
+  FILE *out = m_out;
+  m_out = NULL;
+  m_out = append_sections_to(out, m_file_name, m_compress_command, section_files);
+
+  if (m_anon_out != NULL) {
+    out = m_anon_out;
+    m_anon_out = NULL;
+    m_anon_out = append_sections_to(out, m_anon_file_name, m_compress_command, anon_section_files);
+  }
 }
 
 void xml_writer::pimpl::begin(const char *name) {
@@ -343,11 +470,13 @@ void xml_writer::pimpl::end_discussion() {
   end();
 }
 
-void xml_writer::pimpl::add_comment(const changeset_comment &c, const std::string &display_name, user_info_level uil) {
+void xml_writer::pimpl::add_comment(const changeset_comment &c, const char *display_name, user_info_level uil) {
   begin("comment");
   if (uil == user_info_level::FULL) {
+      begin_user_info();
       attribute("uid", c.author_id);
       attribute("user", display_name);
+      end_user_info();
   }
   attribute("date", c.created_at);
   begin("text");
@@ -362,10 +491,7 @@ namespace {
  * write attributes which are common to nodes, ways and relations.
  */
 template <typename T>
-void write_common_attributes(const T &t, xml_writer::pimpl &impl, 
-                             const xml_writer::changeset_map_t &changesets,
-                             const xml_writer::user_map_t &users,
-                             user_info_level uil) {
+void write_common_attributes(const T &t, xml_writer::pimpl &impl, user_info_level uil) {
   impl.attribute("timestamp", t.timestamp);
   impl.attribute("version", t.version);
   impl.attribute("changeset", t.changeset_id);
@@ -373,16 +499,12 @@ void write_common_attributes(const T &t, xml_writer::pimpl &impl,
   // at least the current planetdump script doesn't add them.
   if (impl.m_has_history) { impl.attribute("visible", t.visible); }
   
-  xml_writer::changeset_map_t::const_iterator cs_itr = changesets.end();
-  if (uil == user_info_level::FULL) {
-    cs_itr = changesets.find(t.changeset_id);
-  }
-  if (cs_itr != changesets.end()) {
-    xml_writer::user_map_t::const_iterator user_itr = users.find(*cs_itr);
-    if (user_itr != users.end()) {
-      impl.attribute("user", user_itr->second);
-      impl.attribute("uid", user_itr->first);
-    }
+  // the user was resolved in the join, and is null if not public.
+  if ((uil == user_info_level::FULL) && (t.user != NULL)) {
+    impl.begin_user_info();
+    impl.attribute("user", t.user->display_name);
+    impl.attribute("uid", t.user->id);
+    impl.end_user_info();
   }
 }
 
@@ -408,9 +530,10 @@ void write_tags(int64_t id, int64_t version,
 } // anonymous namespace
 
 xml_writer::xml_writer(const std::string &file_name, const boost::program_options::variables_map &options,
-                       const user_map_t &users, const pt::ptime &max_time, user_info_level uil, 
+                       const user_index &users, const pt::ptime &max_time, user_info_level uil, 
                        historical_versions hv, changeset_discussions cd)
-  : m_impl(new pimpl(file_name, options, max_time, hv == historical_versions::FULL))
+  : m_impl(new pimpl(file_name, std::string(), compress_command(file_name, options), max_time,
+                     hv == historical_versions::FULL, false))
   , m_users(users)
   , m_changeset_discussions(cd)
   , m_user_info_level(uil)
@@ -418,8 +541,56 @@ xml_writer::xml_writer(const std::string &file_name, const boost::program_option
   , m_author_name(options["meta-author"].as<std::string>())
   , m_source_name(options["meta-source"].as<std::string>())
   , m_copyleft_name(options["meta-copyleft"].as<std::string>())
-  , m_attribution_name(options["meta-attribution"].as<std::string>()) {
+  , m_attribution_name(options["meta-attribution"].as<std::string>())
+  , m_is_section(false)
+  , m_section_files(int(nwr_relation) + 1) {
+
+  write_header();
+}
 
+xml_writer::xml_writer(const std::string &file_name, const std::string &anon_file_name,
+                       const boost::program_options::variables_map &options,
+                       const user_index &users, const pt::ptime &max_time,
+                       historical_versions hv, changeset_discussions cd)
+  : m_impl(new pimpl(file_name, anon_file_name, compress_command(file_name, options), max_time,
+                     hv == historical_versions::FULL, false))
+  , m_users(users)
+  , m_changeset_discussions(cd)
+  // the user info is written, and then left out of the second file.
+  , m_user_info_level(user_info_level::FULL)
+  , m_generator_name(options["generator"].as<std::string>())
+  , m_author_name(options["meta-author"].as<std::string>())
+  , m_source_name(options["meta-source"].as<std::string>())
+  , m_copyleft_name(options["meta-copyleft"].as<std::string>())
+  , m_attribution_name(options["meta-attribution"].as<std::string>())
+  , m_is_section(false)
+  , m_section_files(int(nwr_relation) + 1) {
+
+  write_header();
+}
+
+xml_writer::xml_writer(const xml_writer &parent, const std::string &section_file,
+                       const std::string &anon_section_file)
+  : m_impl(new pimpl(section_file, anon_section_file, parent.m_impl->m_compress_command, parent.m_impl->m_now,
+                     parent.m_impl->m_has_history, true))
+  , m_users(parent.m_users)
+  , m_changeset_discussions(parent.m_changeset_discussions)
+  , m_user_info_level(parent.m_user_info_level)
+  , m_generator_name(parent.m_generator_name)
+  , m_author_name(parent.m_author_name)
+  , m_source_name(parent.m_source_name)
+  , m_copyleft_name(parent.m_copyleft_name)
+  , m_attribution_name(parent.m_attribution_name)
+  , m_is_section(true) {
+
+  // write the same header as the parent, but muted, so that the elements in
+  // this section are nested (and indented) exactly as if they had been
+  // written by the parent.
+  write_header();
+  m_impl->unmute();
+}
+
+void xml_writer::write_header() {
   m_impl->begin("osm");
   m_impl->attribute("license",     m_copyleft_name);
   m_impl->attribute("copyright",   m_author_name);
@@ -459,16 +630,15 @@ void xml_writer::changesets(const std::vector<changeset> &css,
     }
     m_impl->attribute("open", open);
 
-    user_map_t::const_iterator user_itr = m_users.end();
+    const user_info *user = NULL;
     if (m_user_info_level == user_info_level::FULL) {
-      user_itr = m_users.find(cs.uid);
+      user = m_users.find(cs.uid);
     }
-    if (user_itr != m_users.end()) {
-      m_impl->attribute("user", user_itr->second);
-      m_impl->attribute("uid", user_itr->first);
-      // it is ok to only insert this in the "full user info" case since
-      // future uses are tied to full user info too
-      m_changesets.insert(std::make_pair(cs.id, user_itr->first));
+    if (user != NULL) {
+      m_impl->begin_user_info();
+      m_impl->attribute("user", user->display_name);
+      m_impl->attribute("uid", user->id);
+      m_impl->end_user_info();
     }
     
     if (cs.min_lat && cs.max_lat && cs.min_lon && cs.max_lon) {
@@ -511,14 +681,14 @@ void xml_writer::changesets(const std::vector<changeset> &css,
       for (; comment_itr != comment_count_itr; ++comment_itr) {
         if ((comment_itr->changeset_id == cs.id) &&
             (comment_itr->visible)) {
-          user_map_t::const_iterator author_itr = m_users.find(comment_itr->author_id);
-          if (author_itr == m_users.end()) {
+          const user_info *author = m_users.find(comment_itr->author_id);
+          if (author == NULL) {
             // a user with data_public managed to make a comment?
             std::cerr << "User " << comment_itr->author_id << " with "
                       << "data_public=false made a comment on changeset "
                       << comment_itr->changeset_id << "? Ignoring.\n";
           } else {
-            m_impl->add_comment(*comment_itr, author_itr->second, m_user_info_level);
+            m_impl->add_comment(*comment_itr, author->display_name, m_user_info_level);
           }
         }
       }
@@ -547,7 +717,7 @@ void xml_writer::nodes(const std::vector<node> &ns,
       m_impl->attribute("lon", double(n.longitude) / SCALE);
     }
 
-    write_common_attributes<node>(n, *m_impl, m_changesets, m_users, m_user_info_level);
+    write_common_attributes<node>(n, *m_impl, m_user_info_level);
 
     // deleted nodes shouldn't have tags.
     if (n.visible) {
@@ -568,7 +738,7 @@ void xml_writer::ways(const std::vector<way> &ws,
     m_impl->begin("way");
     m_impl->attribute("id", w.id);
 
-    write_common_attributes<way>(w, *m_impl, m_changesets, m_users, m_user_info_level);
+    write_common_attributes<way>(w, *m_impl, m_user_info_level);
 
     // deleted ways shouldn't have nodes or tags, or at least we
     // shouldn't output them.
@@ -601,7 +771,7 @@ void xml_writer::relations(const std::vector<relation> &rs,
   BOOST_FOREACH(const relation &r, rs) {
     m_impl->begin("relation");
     m_impl->attribute("id", r.id);
-    write_common_attributes<relation>(r, *m_impl, m_changesets, m_users, m_user_info_level);
+    write_common_attributes<relation>(r, *m_impl, m_user_info_level);
 
     // deleted relations don't have members or tags, or shouldn't have
     // them output anyway.
@@ -632,7 +802,36 @@ void xml_writer::relations(const std::vector<relation> &rs,
   }
 }
 
+boost::shared_ptr<output_writer> xml_writer::section(nwr_enum type) {
+  const std::string file_name = section_file_name(m_impl->m_file_name, type);
+  std::string anon_file_name;
+  if (!m_impl->m_anon_file_name.empty()) {
+    anon_file_name = section_file_name(m_impl->m_anon_file_name, type);
+  }
+  m_section_files[type] = file_name;
+  return boost::shared_ptr<output_writer>(new xml_writer(*this, file_name, anon_file_name));
+}
+
 void xml_writer::finish() {
+  if (m_is_section) {
+    // the closing tag belongs to the parent's output, not this fragment.
+    m_impl->mute();
+
+  } else {
+    std::vector<std::string> section_files, anon_section_files;
+    for (int i = 0; i < int(m_section_files.size()); ++i) {
+      if (!m_section_files[i].empty()) {
+        section_files.push_back(m_section_files[i]);
+        if (!m_impl->m_anon_file_name.empty()) {
+          anon_section_files.push_back(section_file_name(m_impl->m_anon_file_name, nwr_enum(i)));
+        }
+      }
+    }
+    if (!section_files.empty()) {
+      m_impl->append_sections(section_files, anon_section_files);
+    }
+  }
+
   m_impl->end(); // </osm>
   m_impl->finish();
 }
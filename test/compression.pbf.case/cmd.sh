@@ -0,0 +1,58 @@
+#!/bin/bash
+
+GENERATOR="planet-dump-ng test X.Y.Z"
+DUMP=$1/test/liechtenstein-2013-08-03.dmp
+
+# unknown compressions and levels out of range must be refused.
+for opts in "--pbf-compression brotli" \
+            "--pbf-compression zlib --pbf-compression-level 10" \
+            "--pbf-compression zlib --pbf-compression-level=-1" \
+            "--pbf-compression none --pbf-compression-level 1"; do
+    if $1/planet-dump-ng --generator "$GENERATOR" $opts --pbf rejected.osm.pbf --dump-file $DUMP 2> /dev/null; then
+        echo "Compression options '$opts' were accepted." 1>&2
+        exit 1
+    fi
+done
+
+# the blocks are compared with a python script, so the rest needs python.
+command -v python3 > /dev/null || exit 77
+
+$1/planet-dump-ng --generator "$GENERATOR" --pbf planet.osm.pbf --dump-file $DUMP || exit 1
+python3 $1/test/pbf-blocks.py planet.osm.pbf > zlib.blocks || exit $?
+
+# each of the other compressions this build supports must give the same
+# blocks as zlib. none is always supported. the outputs aren't named *.pbf,
+# as there's no fixture to compare them against byte for byte.
+tested=0
+for codec in none zstd lz4; do
+    $1/planet-dump-ng --generator "$GENERATOR" --pbf-compression $codec --pbf planet.osm.pbf.$codec --dump-file $DUMP 2> $codec.err
+    if [ $? -ne 0 ]; then
+        if grep -q "isn't supported by this build" $codec.err; then
+            continue
+        fi
+        cat $codec.err 1>&2
+        exit 1
+    fi
+
+    python3 $1/test/pbf-blocks.py planet.osm.pbf.$codec > $codec.blocks || exit $?
+    if ! cmp zlib.blocks $codec.blocks; then
+        echo "Blocks compressed with $codec differ from zlib." 1>&2
+        exit 1
+    fi
+
+    # and an explicit level must be accepted, except by none, which has no
+    # levels.
+    if [ $codec = none ]; then
+        tested=$((tested + 1))
+        continue
+    fi
+    $1/planet-dump-ng --generator "$GENERATOR" --pbf-compression $codec --pbf-compression-level 1 --pbf planet.osm.pbf.$codec --dump-file $DUMP || exit 1
+    python3 $1/test/pbf-blocks.py planet.osm.pbf.$codec > $codec.blocks || exit $?
+    cmp zlib.blocks $codec.blocks || exit 1
+    tested=$((tested + 1))
+done
+
+# skip, rather than pass, if no other compression could be tested.
+if [ $tested -eq 0 ]; then
+    exit 77
+fi
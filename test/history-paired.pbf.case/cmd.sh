@@ -0,0 +1,23 @@
+#!/bin/bash
+
+GENERATOR="planet-dump-ng test X.Y.Z"
+DUMP=$1/test/liechtenstein-2013-08-03.dmp
+
+# an output and its no-userinfo variant are written together by one writer.
+# the full output must be the same as when it's written on its own, which
+# the runner checks against the fixture.
+$1/planet-dump-ng --generator "$GENERATOR" --history-pbf history.osm.pbf --history-pbf-no-userinfo history-no-userinfo.osm.pbf.paired --dump-file $DUMP || exit 1
+
+# the no-userinfo variant on its own is also checked against its fixture.
+$1/planet-dump-ng --generator "$GENERATOR" --history-pbf-no-userinfo history-no-userinfo.osm.pbf --dump-file $DUMP || exit 1
+
+# the paired no-userinfo output has its blocks cut where the full output's
+# are, so can differ from the one written on its own, but must have the same
+# elements.
+command -v python3 > /dev/null || exit 77
+python3 $1/test/pbf-elements.py history-no-userinfo.osm.pbf > standalone.elements || exit $?
+python3 $1/test/pbf-elements.py history-no-userinfo.osm.pbf.paired > paired.elements || exit $?
+if ! cmp standalone.elements paired.elements; then
+    echo "Paired no-userinfo output has different elements to the standalone one." 1>&2
+    exit 1
+fi
@@ -0,0 +1,6 @@
+#!/bin/bash
+
+# each output written on its own, rather than with its no-userinfo variant
+# by one writer, as in history.xml.case.
+$1/planet-dump-ng --generator "planet-dump-ng test X.Y.Z" --history-xml history.osm.bz2 --dump-file $1/test/liechtenstein-2013-08-03.dmp || exit 1
+$1/planet-dump-ng --generator "planet-dump-ng test X.Y.Z" --history-xml-no-userinfo history-no-userinfo.osm.bz2 --dump-file $1/test/liechtenstein-2013-08-03.dmp
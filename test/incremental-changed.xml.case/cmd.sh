@@ -0,0 +1,8 @@
+#!/bin/bash
+
+# extract the databases from one dump, then incrementally from another in
+# which node 2 has moved, but has the same version and a timestamp inside
+# the overlap. the row from the dump must be kept over the previous one.
+mkdir previous
+(cd previous && $1/planet-dump-ng --generator "planet-dump-ng test X.Y.Z" --history-xml history.osm.bz2 --dump-file $1/test/missing-node.dmp) || exit 1
+$1/planet-dump-ng --generator "planet-dump-ng test X.Y.Z" --previous-run previous --history-xml history.osm.bz2 --dump-file $1/test/changed-node.dmp
@@ -0,0 +1,7 @@
+#!/bin/bash
+
+# extract the databases once, then again incrementally on top of those. as
+# the dump is the same, only the rows in the overlap are sorted again.
+mkdir previous
+(cd previous && $1/planet-dump-ng --generator "planet-dump-ng test X.Y.Z" --history-pbf history.osm.pbf --dump-file $1/test/liechtenstein-2013-08-03.dmp)
+$1/planet-dump-ng --generator "planet-dump-ng test X.Y.Z" --previous-run previous --pbf planet.osm.pbf --history-pbf history.osm.pbf --dump-file $1/test/liechtenstein-2013-08-03.dmp
@@ -0,0 +1,3 @@
+#!/bin/bash
+
+$1/planet-dump-ng --generator "planet-dump-ng test X.Y.Z" --interleave true --join-threads 3 --pbf planet.osm.pbf --history-pbf history.osm.pbf --dump-file $1/test/liechtenstein-2013-08-03.dmp
@@ -0,0 +1,9 @@
+#!/bin/bash
+
+# the way refers to node 3, which has been deleted, and node 4, which never
+# existed. both must get the undefined location.
+$1/planet-dump-ng --generator "planet-dump-ng test X.Y.Z" --pbf-locations-on-ways true --pbf planet.osm.pbf --dump-file $1/test/missing-node.dmp || exit 1
+
+command -v python3 > /dev/null || exit 77
+summary=`python3 $1/test/pbf-way-locations.py planet.osm.pbf` || exit 1
+[ "$summary" = "ways 1 way nodes 4 missing 2" ] || { echo "Unexpected way locations: $summary" 1>&2; exit 1; }
@@ -0,0 +1,9 @@
+#!/bin/bash
+
+$1/planet-dump-ng --generator "planet-dump-ng test X.Y.Z" --pbf-locations-on-ways true --pbf planet.osm.pbf --dump-file $1/test/liechtenstein-2013-08-03.dmp || exit 1
+
+# check the locations against the nodes independently of the fixture, which
+# was written by the same code.
+command -v python3 > /dev/null || exit 77
+summary=`python3 $1/test/pbf-way-locations.py planet.osm.pbf` || exit 1
+[ "$summary" = "ways 7121 way nodes 74163 missing 0" ] || { echo "Unexpected way locations: $summary" 1>&2; exit 1; }
@@ -0,0 +1,20 @@
+#!/usr/bin/env python3
+#
+# prints the type, uncompressed size and SHA-1 of each block in a PBF file,
+# one per line, so that files which differ only in how their blobs are
+# compressed can be compared.
+
+import hashlib
+import sys
+
+import pbf
+
+
+def main(file_name):
+    for block_type, data in pbf.blocks(file_name):
+        print("%s %d %s" % (block_type, len(data),
+                            hashlib.sha1(data).hexdigest()))
+
+
+if __name__ == "__main__":
+    main(sys.argv[1])
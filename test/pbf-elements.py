@@ -0,0 +1,124 @@
+#!/usr/bin/env python3
+#
+# prints the elements in a PBF file, one per line, with their metadata, tags
+# and locations, way nodes or members, so that files which only differ in
+# where their blocks are cut can be compared.
+
+import sys
+
+import pbf
+
+
+def zigzag(v):
+    return (v >> 1) ^ -(v & 1)
+
+
+def signed(v):
+    return v - (1 << 64) if v >= (1 << 63) else v
+
+
+def packed(buf):
+    values = []
+    pos = 0
+    while pos < len(buf):
+        v, pos = pbf.varint(buf, pos)
+        values.append(v)
+    return values
+
+
+def deltas(buf):
+    values = []
+    total = 0
+    for v in packed(buf):
+        total += zigzag(v)
+        values.append(total)
+    return values
+
+
+def fields_of(buf):
+    """the fields of a message, as a dict of lists of values."""
+    fs = {}
+    for num, value in pbf.fields(buf):
+        fs.setdefault(num, []).append(value)
+    return fs
+
+
+def first(fs, num, default=None):
+    return fs[num][0] if num in fs else default
+
+
+def tags(strings, keys, vals):
+    return " ".join("%s=%s" % (strings[k], strings[v]) for k, v in zip(keys, vals))
+
+
+def info(strings, buf):
+    fs = fields_of(buf)
+    return "v%d t%d c%d u%s %s %s" % (
+        first(fs, 1, -1), signed(first(fs, 2, 0)), signed(first(fs, 3, 0)),
+        signed(first(fs, 4, 0)), strings[first(fs, 5, 0)], first(fs, 6, 1))
+
+
+def dense_nodes(strings, location, buf):
+    fs = fields_of(buf)
+    ids = deltas(first(fs, 1, b""))
+    lats = deltas(first(fs, 8, b""))
+    lons = deltas(first(fs, 9, b""))
+    di = fields_of(first(fs, 5, b""))
+    versions = packed(first(di, 1, b""))
+    timestamps = deltas(first(di, 2, b""))
+    changesets = deltas(first(di, 3, b""))
+    uids = deltas(first(di, 4, b""))
+    users = deltas(first(di, 5, b""))
+    visibles = packed(first(di, 6, b"")) or [1] * len(ids)
+    keys_vals = packed(first(fs, 10, b""))
+    pos = 0
+    for i, node_id in enumerate(ids):
+        keys, vals = [], []
+        while pos < len(keys_vals) and keys_vals[pos] != 0:
+            keys.append(keys_vals[pos])
+            vals.append(keys_vals[pos + 1])
+            pos += 2
+        pos += 1
+        print("node %d v%d t%d c%d u%d %s %d %r %s" % (
+            node_id, versions[i], timestamps[i], changesets[i], uids[i],
+            strings[users[i]], visibles[i], location(lats[i], lons[i]),
+            tags(strings, keys, vals)))
+
+
+def main(file_name):
+    for block_type, data in pbf.blocks(file_name):
+        if block_type != "OSMData":
+            continue
+        block = fields_of(data)
+        strings = [s.decode() for s in fields_of(first(block, 1, b"")).get(1, [])]
+        granularity = first(block, 17, 100)
+        lat_offset = signed(first(block, 19, 0))
+        lon_offset = signed(first(block, 20, 0))
+
+        def location(lat, lon):
+            return (lat_offset + granularity * lat, lon_offset + granularity * lon)
+
+        for group in block.get(2, []):
+            for kind, element in pbf.fields(group):
+                if kind == 2:
+                    dense_nodes(strings, location, element)
+                    continue
+                fs = fields_of(element)
+                head = "%s %d %s %s" % (
+                    {1: "node", 3: "way", 4: "relation"}[kind],
+                    zigzag(fs[1][0]) if kind == 1 else fs[1][0],
+                    info(strings, first(fs, 4, b"")),
+                    tags(strings, packed(first(fs, 2, b"")), packed(first(fs, 3, b""))))
+                if kind == 1:
+                    print("%s %r" % (head, location(zigzag(fs[8][0]), zigzag(fs[9][0]))))
+                elif kind == 3:
+                    print("%s %r %r %r" % (head, deltas(first(fs, 8, b"")),
+                                           deltas(first(fs, 9, b"")), deltas(first(fs, 10, b""))))
+                else:
+                    roles = [strings[r] for r in packed(first(fs, 8, b""))]
+                    print("%s %r" % (head, list(zip(roles, deltas(first(fs, 9, b"")),
+                                                    packed(first(fs, 10, b""))))))
+
+
+if __name__ == "__main__":
+    main(sys.argv[1])
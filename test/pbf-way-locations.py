@@ -0,0 +1,108 @@
+#!/usr/bin/env python3
+#
+# checks the locations on the ways in a PBF file against the nodes in the
+# same file. each way node must have the location of the node it refers to,
+# or the undefined location if that node isn't in the file. prints the number
+# of ways, way nodes and way nodes without a node, and exits non-zero if any
+# location is wrong.
+
+import sys
+
+import pbf
+
+# the location of way nodes which refer to nodes not in the file.
+UNDEFINED = 2 ** 31 - 1
+
+
+def zigzag(v):
+    return (v >> 1) ^ -(v & 1)
+
+
+def packed(buf):
+    values = []
+    pos = 0
+    while pos < len(buf):
+        v, pos = pbf.varint(buf, pos)
+        values.append(v)
+    return values
+
+
+def deltas(buf):
+    values = []
+    total = 0
+    for v in packed(buf):
+        total += zigzag(v)
+        values.append(total)
+    return values
+
+
+def main(file_name):
+    nodes = {}
+    ways = []
+
+    for block_type, data in pbf.blocks(file_name):
+        if block_type != "OSMData":
+            continue
+        block = list(pbf.fields(data))
+        granularity = 100
+        lat_offset = 0
+        lon_offset = 0
+        for num, value in block:
+            if num == 17:
+                granularity = value
+            elif num == 19:
+                lat_offset = zigzag(value)
+            elif num == 20:
+                lon_offset = zigzag(value)
+
+        # locations, in nanodegrees, of the raw values stored in this block.
+        def location(lat, lon):
+            if (lat, lon) == (UNDEFINED, UNDEFINED):
+                return None
+            return (lat_offset + granularity * lat,
+                    lon_offset + granularity * lon)
+
+        for num, group in block:
+            if num != 2:
+                continue
+            for kind, element in pbf.fields(group):
+                fs = list(pbf.fields(element))
+                if kind == 1:
+                    f = dict(fs)
+                    nodes[zigzag(f[1])] = location(zigzag(f[8]), zigzag(f[9]))
+                elif kind == 2:
+                    f = dict(fs)
+                    ids = deltas(f[1])
+                    lats = deltas(f.get(8, b""))
+                    lons = deltas(f.get(9, b""))
+                    for i, lat, lon in zip(ids, lats, lons):
+                        nodes[i] = location(lat, lon)
+                elif kind == 3:
+                    f = dict(fs)
+                    refs = deltas(f.get(8, b""))
+                    lats = deltas(f.get(9, b""))
+                    lons = deltas(f.get(10, b""))
+                    if not (len(refs) == len(lats) == len(lons)):
+                        sys.stderr.write("way %d has %d refs but %d lats and %d lons\n"
+                                         % (f[1], len(refs), len(lats), len(lons)))
+                        sys.exit(1)
+                    ways.append((f[1], refs, [location(a, b) for a, b in zip(lats, lons)]))
+
+    num_refs = 0
+    num_missing = 0
+    for way_id, refs, locations in ways:
+        for ref, loc in zip(refs, locations):
+            num_refs += 1
+            expected = nodes.get(ref)
+            if expected is None:
+                num_missing += 1
+            if loc != expected:
+                sys.stderr.write("way %d node %d has location %r, expected %r\n"
+                                 % (way_id, ref, loc, expected))
+                sys.exit(1)
+
+    print("ways %d way nodes %d missing %d" % (len(ways), num_refs, num_missing))
+
+
+if __name__ == "__main__":
+    main(sys.argv[1])
@@ -0,0 +1,118 @@
+# helpers for the test scripts which read PBF files: a minimal protobuf
+# decoder and the decompression of blobs. exits with 77, which the tests take
+# as a skip, if a blob's compression can't be decoded here.
+
+import ctypes
+import struct
+import sys
+import zlib
+
+SKIP = 77
+
+
+def varint(buf, pos):
+    result = 0
+    shift = 0
+    while True:
+        b = buf[pos]
+        pos += 1
+        result |= (b & 0x7f) << shift
+        if b < 0x80:
+            return result, pos
+        shift += 7
+
+
+def fields(buf):
+    pos = 0
+    while pos < len(buf):
+        key, pos = varint(buf, pos)
+        num, wire = key >> 3, key & 7
+        if wire == 0:
+            value, pos = varint(buf, pos)
+        elif wire == 2:
+            size, pos = varint(buf, pos)
+            value = buf[pos:pos + size]
+            pos += size
+        elif wire == 1:
+            value = buf[pos:pos + 8]
+            pos += 8
+        elif wire == 5:
+            value = buf[pos:pos + 4]
+            pos += 4
+        else:
+            raise ValueError("unexpected wire type %d" % wire)
+        yield num, value
+
+
+def load(names):
+    for name in names:
+        try:
+            return ctypes.CDLL(name)
+        except OSError:
+            pass
+    return None
+
+
+def unsupported(codec):
+    sys.stderr.write("unable to decode %s blobs here\n" % codec)
+    sys.exit(SKIP)
+
+
+def unzstd(data, raw_size):
+    lib = load(["libzstd.so.1", "libzstd.so", "libzstd.dylib"])
+    if lib is None:
+        unsupported("zstd")
+    lib.ZSTD_decompress.restype = ctypes.c_size_t
+    lib.ZSTD_decompress.argtypes = [ctypes.c_void_p, ctypes.c_size_t,
+                                    ctypes.c_char_p, ctypes.c_size_t]
+    out = ctypes.create_string_buffer(raw_size)
+    n = lib.ZSTD_decompress(out, raw_size, data, len(data))
+    if n != raw_size:
+        raise ValueError("bad zstd blob")
+    return out.raw
+
+
+def unlz4(data, raw_size):
+    lib = load(["liblz4.so.1", "liblz4.so", "liblz4.dylib"])
+    if lib is None:
+        unsupported("lz4")
+    lib.LZ4_decompress_safe.restype = ctypes.c_int
+    lib.LZ4_decompress_safe.argtypes = [ctypes.c_char_p, ctypes.c_void_p,
+                                        ctypes.c_int, ctypes.c_int]
+    out = ctypes.create_string_buffer(raw_size)
+    n = lib.LZ4_decompress_safe(data, out, len(data), raw_size)
+    if n != raw_size:
+        raise ValueError("bad lz4 blob")
+    return out.raw
+
+
+def blob_data(blob):
+    raw_size = None
+    for num, value in fields(blob):
+        if num == 2:
+            raw_size = value
+    for num, value in fields(blob):
+        if num == 1:
+            return value
+        if num == 3:
+            return zlib.decompress(value)
+        if num == 6:
+            return unlz4(value, raw_size)
+        if num == 7:
+            return unzstd(value, raw_size)
+    unsupported("these")
+
+
+def blocks(file_name):
+    """yields the type and the uncompressed data of each block in the file."""
+    with open(file_name, "rb") as f:
+        buf = f.read()
+    pos = 0
+    while pos < len(buf):
+        size, = struct.unpack(">I", buf[pos:pos + 4])
+        pos += 4
+        header = dict(fields(buf[pos:pos + size]))
+        pos += size
+        data = blob_data(buf[pos:pos + header[3]])
+        pos += header[3]
+        yield header[1].decode(), data